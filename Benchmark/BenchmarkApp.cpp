@@ -0,0 +1,342 @@
+#include "BenchmarkApp.h"
+
+#include <Urho3D/Core/ProcessUtils.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Engine/Engine.h>
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/Physics/CollisionShape.h>
+#include <Urho3D/Physics/PhysicsEvents.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Scene.h>
+
+
+// Control bits, the same as the example's
+static const unsigned CTRL_FORWARD = 1;
+static const unsigned CTRL_BACK = 2;
+static const unsigned CTRL_LEFT = 4;
+static const unsigned CTRL_RIGHT = 8;
+
+// Physics ticks per second
+static const int FPS = 60;
+
+
+BenchmarkApp::BenchmarkApp(Context* context) :
+Application(context)
+{
+	CSP_Client::RegisterObject(context);
+	CSP_Server::RegisterObject(context);
+}
+
+
+void BenchmarkApp::Setup()
+{
+	engineParameters_["Headless"] = true;
+	engineParameters_["Sound"] = false;
+	engineParameters_["LogLevel"] = LOG_WARNING;
+	// No resources needed
+	engineParameters_["ResourcePaths"] = "";
+	engineParameters_["ResourcePackages"] = "";
+	engineParameters_["AutoloadPaths"] = "";
+}
+
+
+void BenchmarkApp::Start()
+{
+	OpenConsoleWindow();
+
+	PODVector<Case> cases;
+	unsigned clients = 0;
+	unsigned entities = 0;
+
+	const auto& arguments = GetArguments();
+	for (unsigned i = 0; i < arguments.Size(); ++i)
+	{
+		const auto argument = arguments[i].ToLower();
+		const auto has_value = i + 1 < arguments.Size();
+		if (argument == "-clients" && has_value)
+			clients = ToUInt(arguments[++i]);
+		else if (argument == "-entities" && has_value)
+			entities = ToUInt(arguments[++i]);
+		else if (argument == "-ticks" && has_value)
+			ticks = Max(ToUInt(arguments[++i]), 1u);
+		else if (argument == "-full")
+			full_snapshots = true;
+		else if (argument == "-latency" && has_value)
+			link.latency = ToFloat(arguments[++i]) / 1000.f;
+		else if (argument == "-jitter" && has_value)
+			link.jitter = ToFloat(arguments[++i]) / 1000.f;
+		else if (argument == "-loss" && has_value)
+			link.loss = ToFloat(arguments[++i]) / 100.f;
+		else if (argument == "-seed" && has_value)
+			seed = ToUInt(arguments[++i]);
+		else if (argument == "-trace" && has_value)
+			trace_path = arguments[++i];
+		else if (argument == "-record" && has_value)
+			record_path = arguments[++i];
+		else if (argument == "-play" && has_value)
+		{
+			if (!player.open(arguments[++i]))
+			{
+				PrintLine("Could not open the recording " + arguments[i], true);
+				engine_->Exit();
+				return;
+			}
+			// A client per recorded connection
+			if (clients == 0)
+				clients = player.get_peers().Size();
+		}
+	}
+
+	if (clients > 0)
+		cases.Push({ clients, entities });
+	else
+	{
+		for (auto case_clients : { 1u, 8u, 32u })
+		{
+			for (auto case_entities : { 100u, 1000u })
+				cases.Push({ case_clients, case_entities });
+		}
+	}
+
+	PrintLine(ToString("%u ticks per case, %s snapshots", ticks, full_snapshots ? "full" : "quantized"));
+	if (player.is_open())
+		PrintLine(ToString("Playing a recording of %u connections, ticks %u to %u", player.get_peers().Size(), player.get_first_tick(), player.get_last_tick()));
+	if (is_impaired())
+		PrintLine(ToString("%.0f ms latency, %.0f ms jitter, %.1f%% loss, seed %u", link.latency * 1000.f, link.jitter * 1000.f, link.loss * 100.f, seed));
+	PrintLine("clients  entities  ticks/s  encode ms  decode ms  replay ms  bytes down  bytes up");
+	// Tracing costs time itself, the results of a traced run aren't comparable with untraced ones
+	Tracer::set_enabled(!trace_path.Empty());
+
+	for (auto& benchmark_case : cases)
+	{
+		// Only keep the last case's events
+		Tracer::clear();
+		const auto result = run(benchmark_case);
+		PrintLine(ToString("%7u  %8u  %7.1f  %9.3f  %9.3f  %9.3f  %10.0f  %8.0f",
+			benchmark_case.clients, benchmark_case.entities, result.ticks_per_second,
+			result.encode_ms, result.decode_ms, result.replay_ms, result.bytes_down, result.bytes_up));
+	}
+
+	if (!trace_path.Empty() && Tracer::write_json(trace_path))
+		PrintLine("Trace written to " + trace_path);
+	if (!record_path.Empty())
+		PrintLine("Recording written to " + record_path);
+
+	engine_->Exit();
+}
+
+
+BenchmarkApp::Result BenchmarkApp::run(const Case& benchmark_case)
+{
+	const auto timestep = 1.f / FPS;
+
+	// Server
+	auto server_scene = create_scene(benchmark_case);
+	auto server_transport = MakeShared<LoopbackTransport>(context_, true);
+	auto csp_server = server_scene->CreateComponent<CSP_Server>(LOCAL);
+	csp_server->timestep = timestep;
+	csp_server->quantize_snapshots = !full_snapshots;
+	csp_server->transport = server_transport;
+	if (is_impaired())
+		csp_server->transport = new ImpairedTransport(server_transport, link, seed);
+	if (!record_path.Empty())
+	{
+		csp_server->recorder = new Recorder();
+		csp_server->recorder->open(record_path, timestep);
+	}
+	for (auto node : server_scene->GetChildren())
+	{
+		if (node->GetComponent<RigidBody>() && node->GetComponent<RigidBody>()->GetMass() > 0.f)
+			csp_server->add_node(node);
+	}
+
+	// Each client controls the ball with its index
+	HashMap<Object*, WeakPtr<Node>> client_balls;
+	csp_server->apply_client_input = [&](const InputRecord& input, float, Object* connection) {
+		apply_input(client_balls[connection], input);
+	};
+
+	// Clients, and their connections on the server in recorded peer order
+	Vector<BenchmarkClient> clients(benchmark_case.clients);
+	PODVector<Object*> connections;
+	for (unsigned i = 0; i < clients.Size(); ++i)
+	{
+		auto& client = clients[i];
+		client.scene = create_scene(benchmark_case);
+		client.transport = MakeShared<LoopbackTransport>(context_, false);
+		client.csp = MakeShared<CSP_Client>(context_);
+		client.csp->timestep = timestep;
+		client.csp->transport = client.transport;
+		if (is_impaired())
+			client.csp->transport = new ImpairedTransport(client.transport, link, seed + 1 + i);
+
+		auto connection = LoopbackTransport::connect(*server_transport, server_scene, *client.transport, client.scene);
+		connections.Push(connection);
+		client.csp->reset();
+
+		const auto ball_name = "Ball" + String(i);
+		client.ball = client.scene->GetChild(ball_name);
+		client.csp->add_predicted_node(client.ball);
+		client_balls[connection] = server_scene->GetChild(ball_name);
+
+		// Live steps apply the current input, replayed steps the input being replayed
+		auto csp_client = client.csp.Get();
+		auto input = &client.input;
+		auto ball = client.ball;
+		SubscribeToEvent(client.scene->GetComponent<PhysicsWorld>(), E_PHYSICSPRESTEP, [=](StringHash, VariantMap&) {
+			apply_input(ball, csp_client->prediction_input ? *csp_client->prediction_input : *input);
+		});
+	}
+
+	auto receive_on_server = [&](Object* connection, int message_id, MemoryBuffer& message) {
+		csp_server->receive_message(connection, message_id, message);
+	};
+	auto drop = [](Object*, int, MemoryBuffer&) {};
+
+	// Recorded inputs go to the server, recorded states to the client of the same connection
+	auto play_record = [&](const RecordingPlayer::Record& record) {
+		if (record.peer >= clients.Size())
+			return;
+		MemoryBuffer message(record.data, record.size);
+		if (record.message_id == MSG_CSP_INPUT)
+			csp_server->receive_message(connections[record.peer], record.message_id, message);
+		else
+			clients[record.peer].csp->receive_message(record.message_id, message);
+	};
+	if (player.is_open())
+		player.seek(player.get_first_tick());
+
+	HiresTimer timer;
+	for (unsigned tick = 0; tick < ticks; ++tick)
+	{
+		// Clients sample, send and predict
+		for (unsigned i = 0; i < clients.Size(); ++i)
+		{
+			auto& client = clients[i];
+			client.input = script_input(i, tick);
+			client.csp->add_input(client.input);
+			client.scene->GetComponent<PhysicsWorld>()->Update(timestep);
+		}
+
+		// Server applies the inputs, steps and sends snapshots
+		if (player.is_open())
+		{
+			// The messages recorded up to the server's tick, the clients reconcile against the recorded states
+			server_transport->deliver(drop);
+			player.play(player.get_first_tick() + csp_server->get_tick(), play_record);
+		}
+		else
+			server_transport->deliver(receive_on_server);
+		server_scene->GetComponent<PhysicsWorld>()->Update(timestep);
+
+		// Clients reconcile
+		for (auto& client : clients)
+		{
+			auto csp_client = client.csp.Get();
+			if (player.is_open())
+				client.transport->deliver(drop);
+			else
+			{
+				client.transport->deliver([=](Object*, int message_id, MemoryBuffer& message) {
+					csp_client->receive_message(message_id, message);
+				});
+			}
+		}
+	}
+
+	if (csp_server->recorder)
+		csp_server->recorder->close();
+	const auto elapsed = timer.GetUSec(false) / 1000000.f;
+
+	Result result;
+	const auto snapshots = Max(ticks / Max(csp_server->snapshot_tick_divisor, 1u), 1u);
+	result.ticks_per_second = ticks / elapsed;
+	result.encode_ms = csp_server->snapshot_encode_time * 1000.f / snapshots;
+	for (auto& client : clients)
+	{
+		result.decode_ms += client.csp->snapshot_decode_time * 1000.f / (snapshots * clients.Size());
+		result.replay_ms += client.csp->replay_time * 1000.f / (ticks * clients.Size());
+		result.bytes_up += static_cast<float>(client.transport->bytes_sent) / ticks;
+
+		UnsubscribeFromEvent(client.scene->GetComponent<PhysicsWorld>(), E_PHYSICSPRESTEP);
+	}
+	result.bytes_down = static_cast<float>(server_transport->bytes_sent) / ticks;
+
+	return result;
+}
+
+
+SharedPtr<Scene> BenchmarkApp::create_scene(const Case& benchmark_case)
+{
+	auto scene = MakeShared<Scene>(context_);
+
+	auto physicsWorld = scene->CreateComponent<PhysicsWorld>(LOCAL);
+	physicsWorld->SetFps(FPS);
+	physicsWorld->SetInterpolation(false); // needed for determinism
+
+	auto ground = scene->CreateChild("Ground", LOCAL);
+	ground->SetPosition(Vector3(0.f, -0.5f, 0.f));
+	ground->SetScale(Vector3(500.f, 1.f, 500.f));
+	ground->CreateComponent<RigidBody>();
+	ground->CreateComponent<CollisionShape>()->SetBox(Vector3::ONE);
+
+	// Resting entities on a grid, they fall asleep like props do
+	const auto columns = static_cast<unsigned>(Ceil(Sqrt(static_cast<float>(benchmark_case.entities))));
+	for (unsigned i = 0; i < benchmark_case.entities; ++i)
+	{
+		auto entity = scene->CreateChild("Entity");
+		entity->SetPosition(Vector3((i % columns) * 3.f - columns * 1.5f, 0.5f, (i / columns) * 3.f - columns * 1.5f));
+		auto body = entity->CreateComponent<RigidBody>();
+		body->SetMass(1.f);
+		entity->CreateComponent<CollisionShape>()->SetBox(Vector3::ONE);
+	}
+
+	// One ball per client, in a row away from the entities
+	for (unsigned i = 0; i < benchmark_case.clients; ++i)
+	{
+		auto ball = scene->CreateChild("Ball" + String(i));
+		ball->SetPosition(Vector3(i * 4.f - benchmark_case.clients * 2.f, 1.f, columns * 1.5f + 10.f));
+		auto body = ball->CreateComponent<RigidBody>();
+		body->SetMass(1.f);
+		body->SetFriction(1.f);
+		body->SetLinearDamping(0.5f);
+		body->SetAngularDamping(0.5f);
+		ball->CreateComponent<CollisionShape>()->SetSphere(1.f);
+	}
+
+	return scene;
+}
+
+
+InputRecord BenchmarkApp::script_input(unsigned client, unsigned tick) const
+{
+	static const unsigned directions[] = { CTRL_FORWARD, CTRL_LEFT, CTRL_BACK, CTRL_RIGHT };
+
+	// Change direction every second, each client out of phase, turning slowly
+	InputRecord input;
+	input.yaw = (tick + client * 7) * 0.5f;
+	input.set(directions[(tick / FPS + client) % 4], true);
+	return input;
+}
+
+
+void BenchmarkApp::apply_input(Node* ball, const InputRecord& input) const
+{
+	if (!ball)
+		return;
+
+	auto body = ball->GetComponent<RigidBody>();
+	const auto rotation = Quaternion(0.f, input.yaw, 0.f);
+	const float MOVE_TORQUE = 3.f;
+
+	if (input.buttons & CTRL_FORWARD)
+		body->ApplyTorque(rotation * Vector3::RIGHT * MOVE_TORQUE);
+	if (input.buttons & CTRL_BACK)
+		body->ApplyTorque(rotation * Vector3::LEFT * MOVE_TORQUE);
+	if (input.buttons & CTRL_LEFT)
+		body->ApplyTorque(rotation * Vector3::FORWARD * MOVE_TORQUE);
+	if (input.buttons & CTRL_RIGHT)
+		body->ApplyTorque(rotation * Vector3::BACK * MOVE_TORQUE);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Urho3D/Engine/Application.h>
+#include "../CSP_Client.h"
+#include "../CSP_ImpairedTransport.h"
+#include "../CSP_LoopbackTransport.h"
+#include "../CSP_Recording.h"
+#include "../CSP_Server.h"
+#include "../CSP_Trace.h"
+
+namespace Urho3D {
+	class Node;
+	class Scene;
+}
+
+using namespace Urho3D;
+
+
+/*
+Headless benchmark of one CSP_Server and many CSP_Clients in a single process, connected by LoopbackTransport.
+
+Each client simulates its own copy of the scene and sends scripted inputs, the server applies them and sends snapshots.
+Prints ticks per second, snapshot encode and decode time, replay time per client and bytes per tick for
+a range of client and entity counts, or a single case given with -clients, -entities and -ticks.
+-full uses StateSnapshot instead of quantized snapshots.
+-latency and -jitter in milliseconds, -loss in percent and -seed impair both directions with ImpairedTransport.
+-trace writes the last case's trace events to a Chrome trace JSON file.
+-record writes the last case's server traffic to a recording. -play feeds a recording to the server and the clients
+instead of their live messages, the clients still predict with their scripted inputs. Give it the recorded case's -entities.
+*/
+struct BenchmarkApp : Application
+{
+	BenchmarkApp(Context* context);
+
+	void Setup() override;
+	void Start() override;
+
+protected:
+	struct Case
+	{
+		unsigned clients;
+		unsigned entities;
+	};
+
+	struct Result
+	{
+		float ticks_per_second = 0;
+		// Per snapshot, and per snapshot per client
+		float encode_ms = 0;
+		float decode_ms = 0;
+		// Per tick per client
+		float replay_ms = 0;
+		// Server to clients and clients to server, per tick
+		float bytes_down = 0;
+		float bytes_up = 0;
+	};
+
+	struct BenchmarkClient
+	{
+		SharedPtr<Scene> scene;
+		SharedPtr<CSP_Client> csp;
+		SharedPtr<LoopbackTransport> transport;
+		WeakPtr<Node> ball;
+		// Live input of the current tick
+		InputRecord input;
+	};
+
+	// Ticks per case
+	unsigned ticks = 600;
+	// Use StateSnapshot instead of quantized snapshots
+	bool full_snapshots = false;
+	// Link conditions of both directions, and the seed of the first transport
+	LinkProfile link;
+	unsigned seed = 1;
+	// Chrome trace file to write, empty to not trace
+	String trace_path;
+	// Recording to write, empty to not record
+	String record_path;
+	// Recording played instead of the live messages
+	RecordingPlayer player;
+
+	// Whether the link is impaired at all
+	bool is_impaired() const { return link.latency > 0.f || link.jitter > 0.f || link.loss > 0.f; }
+
+	// Run a case and measure it
+	Result run(const Case& benchmark_case);
+	// Create a scene with a ground, resting entities and a ball per client. Node IDs match between the scenes created alike.
+	SharedPtr<Scene> create_scene(const Case& benchmark_case);
+	// Scripted input of a client at a tick
+	InputRecord script_input(unsigned client, unsigned tick) const;
+	// Roll a ball with an input's torque
+	void apply_input(Node* ball, const InputRecord& input) const;
+};
@@ -0,0 +1,4 @@
+#include "BenchmarkApp.h"
+
+
+URHO3D_DEFINE_APPLICATION_MAIN(BenchmarkApp)
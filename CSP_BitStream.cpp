@@ -0,0 +1,62 @@
+#include "CSP_BitStream.h"
+
+#include <Urho3D/IO/Deserializer.h>
+#include <Urho3D/IO/Serializer.h>
+
+static inline unsigned long long bit_mask(unsigned num_bits)
+{
+	return (1ull << num_bits) - 1;
+}
+
+BitWriter::BitWriter(Serializer & dest) :
+	dest(dest)
+{
+}
+
+void BitWriter::write_bits(unsigned value, unsigned num_bits)
+{
+	scratch |= (value & bit_mask(num_bits)) << scratch_bits;
+	scratch_bits += num_bits;
+
+	while (scratch_bits >= 8)
+	{
+		dest.WriteUByte(static_cast<unsigned char>(scratch));
+		scratch >>= 8;
+		scratch_bits -= 8;
+	}
+}
+
+void BitWriter::flush()
+{
+	if (scratch_bits > 0)
+	{
+		dest.WriteUByte(static_cast<unsigned char>(scratch));
+		scratch = 0;
+		scratch_bits = 0;
+	}
+}
+
+
+BitReader::BitReader(Deserializer & source) :
+	source(source)
+{
+}
+
+unsigned BitReader::read_bits(unsigned num_bits)
+{
+	while (scratch_bits < num_bits)
+	{
+		if (source.IsEof())
+		{
+			overflowed = true;
+			return 0;
+		}
+		scratch |= static_cast<unsigned long long>(source.ReadUByte()) << scratch_bits;
+		scratch_bits += 8;
+	}
+
+	const auto value = static_cast<unsigned>(scratch & bit_mask(num_bits));
+	scratch >>= num_bits;
+	scratch_bits -= num_bits;
+	return value;
+}
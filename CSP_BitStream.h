@@ -0,0 +1,51 @@
+#pragma once
+
+namespace Urho3D
+{
+	class Deserializer;
+	class Serializer;
+}
+
+using namespace Urho3D;
+
+
+/*
+Bit level writer.
+Bits are packed least significant first, whole bytes are written to the destination as they fill up.
+*/
+struct BitWriter
+{
+	explicit BitWriter(Serializer& dest);
+
+	// Write the lowest num_bits bits of value, up to 32 bits
+	void write_bits(unsigned value, unsigned num_bits);
+	void write_bool(bool value) { write_bits(value ? 1 : 0, 1); }
+	// Write the remaining partial byte, padded with zeros
+	void flush();
+
+protected:
+	Serializer& dest;
+	unsigned long long scratch = 0;
+	unsigned scratch_bits = 0;
+};
+
+
+/*
+Bit level reader, the counterpart of BitWriter.
+*/
+struct BitReader
+{
+	explicit BitReader(Deserializer& source);
+
+	// Read num_bits bits, up to 32 bits. Returns 0 and sets overflowed when reading past the end.
+	unsigned read_bits(unsigned num_bits);
+	bool read_bool() { return read_bits(1) != 0; }
+
+	// Was there an attempt to read past the end of the source
+	bool overflowed = false;
+
+protected:
+	Deserializer& source;
+	unsigned long long scratch = 0;
+	unsigned scratch_bits = 0;
+};
@@ -0,0 +1,93 @@
+#include "CSP_ChangeTracker.h"
+
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Scene.h>
+
+void ChangeTracker::mark_changed(unsigned node_id, ID epoch)
+{
+	auto& node_epoch = epochs[node_id];
+	if (node_epoch == epoch)
+		return;
+	node_epoch = epoch;
+
+	// Reuse the list of the tick TICKS before
+	const auto slot = epoch % TICKS;
+	if (!change_saved[slot] || change_ticks[slot] != epoch)
+	{
+		changes[slot].Clear();
+		change_ticks[slot] = epoch;
+		change_saved[slot] = true;
+	}
+	changes[slot].Push(node_id);
+}
+
+void ChangeTracker::update_awake(Scene * scene, ID epoch)
+{
+	for (auto it = awake_nodes.Begin(); it != awake_nodes.End();)
+	{
+		auto node = scene->GetNode(*it);
+		auto body = node ? node->GetComponent<RigidBody>() : nullptr;
+		if (body && body->IsActive())
+		{
+			++it;
+			continue;
+		}
+
+		// Falling asleep zeroes the velocities without moving the node
+		if (node)
+			mark_changed(*it, epoch);
+		else
+			epochs.Erase(*it);
+		it = awake_nodes.Erase(it);
+	}
+}
+
+bool ChangeTracker::is_changed_since(unsigned node_id, ID since) const
+{
+	auto it = epochs.Find(node_id);
+	// Handle range looping correctly
+	return it == epochs.End() || int(it->second_ - since) > 0;
+}
+
+bool ChangeTracker::get_changed_since(ID since, ID current, PODVector<unsigned>& result) const
+{
+	// Handle range looping correctly
+	if (int(current - since) >= static_cast<int>(TICKS))
+		return false;
+
+	for (auto tick = since + 1; int(current - tick) >= 0; ++tick)
+	{
+		auto changed = get_changes(tick);
+		if (!changed)
+			continue;
+
+		// A node is listed in each tick it changed in, only take it from its last one
+		for (auto node_id : *changed)
+		{
+			auto it = epochs.Find(node_id);
+			if (it != epochs.End() && it->second_ == tick)
+				result.Push(node_id);
+		}
+	}
+
+	return true;
+}
+
+const PODVector<unsigned>* ChangeTracker::get_changes(ID epoch) const
+{
+	const auto slot = epoch % TICKS;
+	if (!change_saved[slot] || change_ticks[slot] != epoch)
+		return nullptr;
+	return &changes[slot];
+}
+
+void ChangeTracker::clear()
+{
+	epochs.Clear();
+	for (unsigned i = 0; i < TICKS; ++i)
+	{
+		changes[i].Clear();
+		change_saved[i] = false;
+	}
+	awake_nodes.Clear();
+}
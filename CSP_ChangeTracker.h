@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Vector.h>
+
+namespace Urho3D
+{
+	class Scene;
+}
+
+using namespace Urho3D;
+
+
+/*
+Change epochs of the networked nodes on the server, by node ID.
+
+A node's epoch is the last tick its state changed in: its transform was marked dirty,
+or its rigid body fell asleep, which zeroes the velocities without moving it.
+Each tick keeps the list of nodes which changed in it, so the nodes changed since a recent tick
+can be listed without visiting the ones which didn't, such as sleeping props.
+*/
+struct ChangeTracker
+{
+	using ID = unsigned;
+
+	// Ticks of change lists kept, older ticks only tell that everything may have changed
+	static constexpr unsigned TICKS = 64;
+
+	// Stamp a node as changed in a tick
+	void mark_changed(unsigned node_id, ID epoch);
+	// Watch a node with an awake rigid body for falling asleep
+	void mark_awake(unsigned node_id) { awake_nodes.Insert(node_id); }
+	// Stamp the watched nodes whose bodies fell asleep, or which were removed, as changed
+	void update_awake(Scene* scene, ID epoch);
+
+	// Whether a node changed after a tick. Unknown nodes count as changed.
+	bool is_changed_since(unsigned node_id, ID since) const;
+	// Append the nodes changed after a tick, up to the current tick.
+	// Returns false if the tick is too old for the change lists.
+	bool get_changed_since(ID since, ID current, PODVector<unsigned>& result) const;
+	// Nodes changed in a tick, nullptr if the tick isn't kept
+	const PODVector<unsigned>* get_changes(ID epoch) const;
+
+	void clear();
+
+protected:
+	// Last change tick by node ID
+	HashMap<unsigned, ID> epochs;
+	// Nodes changed in each tick, by tick % TICKS
+	PODVector<unsigned> changes[TICKS];
+	ID change_ticks[TICKS] = {};
+	bool change_saved[TICKS] = {};
+
+	// Nodes with awake rigid bodies
+	HashSet<unsigned> awake_nodes;
+};
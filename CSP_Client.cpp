@@ -1,11 +1,11 @@
 #include "CSP_Client.h"
+#include "CSP_Trace.h"
 
 #include <Urho3D/Core/Context.h>
 #include <Urho3D/Core/CoreEvents.h>
-#include <Urho3D/Engine/DebugHud.h>
+#include <Urho3D/Core/Timer.h>
 #include <Urho3D/IO/Log.h>
 #include <Urho3D/IO/MemoryBuffer.h>
-#include <Urho3D/Input/Controls.h>
 #include <Urho3D/Network/Network.h>
 #include <Urho3D/Network/NetworkEvents.h>
 #include <Urho3D/Physics/PhysicsEvents.h>
@@ -13,13 +13,25 @@
 #include <Urho3D/Scene/Scene.h>
 #include <Urho3D/Scene/SceneEvents.h>
 #include <Urho3D/Scene/SmoothedTransform.h>
-#include <algorithm>
+#include <cmath>
 
 CSP_Client::CSP_Client(Context * context) :
 	Object(context)
 {
 	// Receive update messages
 	SubscribeToEvent(E_NETWORKMESSAGE, URHO3D_HANDLER(CSP_Client, HandleNetworkMessage));
+
+	SubscribeToEvent(E_SERVERCONNECTED, URHO3D_HANDLER(CSP_Client, HandleServerConnected));
+	SubscribeToEvent(E_PHYSICSPRESTEP, URHO3D_HANDLER(CSP_Client, HandlePhysicsPreStep));
+	SubscribeToEvent(E_PHYSICSPOSTSTEP, URHO3D_HANDLER(CSP_Client, HandlePhysicsPostStep));
+	SubscribeToEvent(E_SCENEUPDATE, URHO3D_HANDLER(CSP_Client, HandleSceneUpdate));
+
+	// About a second at 60 FPS
+	physics_history.set_capacity(64, 256);
+
+	transport = new NetworkTransport(context);
+	metrics = new MetricsRegistry();
+	bind_metrics();
 }
 
 void CSP_Client::RegisterObject(Context * context)
@@ -27,63 +39,401 @@ void CSP_Client::RegisterObject(Context * context)
 	context->RegisterFactory<CSP_Client>();
 }
 
-void CSP_Client::add_input(Controls & input)
+void CSP_Client::add_input(InputRecord & input)
 {
+	TraceScope trace("add_input");
+
 	// Increment the update ID by 1
 	++id;
+	trace.arg("input", id);
 	// Tag the new input with an id, so the id is passed to the server
-	input.extraData_["id"] = id;
+	input.id = id;
 	// Add the new input to the input buffer
-	input_buffer.push_back(input);
+	input_buffer.push(input);
 
 	// Send to the server
 	send_input(input);
+	transport->update(timestep);
 
-	GetSubsystem<DebugHud>()->SetAppStats("add_input() input_buffer.size(): ", input_buffer.size());
+	bind_metrics();
+	input_buffer_size->set(static_cast<float>(input_buffer.size()));
+	metrics->update();
 }
 
-void CSP_Client::HandleNetworkMessage(StringHash eventType, VariantMap& eventData)
+void CSP_Client::bind_metrics()
+{
+	if (bound_metrics == metrics)
+		return;
+	bound_metrics = metrics;
+
+	input_buffer_size = metrics->gauge("client.input_buffer_size");
+	snapshot_bytes = metrics->histogram("client.snapshot_bytes", { 64.f, 128.f, 256.f, 512.f, 1024.f, 1400.f, 4096.f, 16384.f });
+	rtt_ms = metrics->histogram("client.rtt_ms", { 10.f, 20.f, 40.f, 60.f, 80.f, 100.f, 150.f, 200.f, 300.f, 500.f });
+	replay_depth = metrics->histogram("client.replay_depth", { 0.f, 1.f, 2.f, 4.f, 8.f, 12.f, 16.f, 24.f, 32.f, 64.f });
+	replay_ms = metrics->histogram("client.replay_ms", { 0.1f, 0.25f, 0.5f, 1.f, 2.f, 4.f, 8.f, 16.f });
+	prediction_hits_metric = metrics->counter("client.prediction_hits");
+	prediction_misses_metric = metrics->counter("client.prediction_misses");
+	replays_immediate_metric = metrics->counter("client.replays_immediate");
+	replays_spread_metric = metrics->counter("client.replays_spread");
+	replays_snapped_metric = metrics->counter("client.replays_snapped");
+	time_dilation_metric = metrics->gauge("client.time_dilation");
+	chunked_complete = metrics->gauge("client.chunked_snapshots_complete");
+	chunked_partial = metrics->gauge("client.chunked_snapshots_partial");
+	interpolation_extrapolations = metrics->gauge("client.interpolation_extrapolations");
+	interpolation_underruns = metrics->gauge("client.interpolation_underruns");
+}
+
+Vector3 CSP_Client::get_visual_offset(Node * node) const
+{
+	auto it = visual_offsets.Find(node->GetID());
+	return it != visual_offsets.End() ? it->second_ : Vector3::ZERO;
+}
+
+float CSP_Client::get_render_time() const
 {
-	auto network = GetSubsystem<Network>();
+	// Server time of the newest state arriving now, which left the server half a round trip ago
+	const auto latest = clock_sync.has_samples() ?
+		clock_sync.get_server_time(GetSubsystem<Time>()->GetElapsedTime()) - clock_sync.get_rtt() * 0.5f :
+		int(server_tick - clock_base_tick) * timestep;
+	return latest - interpolation.delay;
+}
 
+void CSP_Client::get_render_tick(ID & tick, float & fraction) const
+{
+	const auto ticks = get_render_time() / timestep;
+	const auto whole = Floor(ticks);
+	tick = clock_base_tick + static_cast<ID>(static_cast<int>(whole));
+	fraction = ticks - whole;
+}
+
+float CSP_Client::get_input_lead() const
+{
+	if (timestep <= 0.f)
+		return 0.f;
+	return clock_sync.get_rtt() * 0.5f / timestep + server_input_depth;
+}
+
+void CSP_Client::HandleNetworkMessage(StringHash eventType, VariantMap& eventData)
+{
 	using namespace NetworkMessage;
 	const auto message_id = eventData[P_MESSAGEID].GetInt();
-	auto connection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
 	MemoryBuffer message(eventData[P_DATA].GetBuffer());
 
-	if (network->GetServerConnection())
+	receive_message(message_id, message);
+}
+
+void CSP_Client::receive_message(int message_id, MemoryBuffer & message)
+{
+	bind_metrics();
+
+	if (transport->get_server())
 	{
 		switch (message_id)
 		{
 		case MSG_CSP_STATE:
+		{
 			URHO3D_LOGDEBUG("MSG_CSP_STATE");
-			// read last input
-			read_last_id(message);
-			// read state snapshot
-			auto scene = network->GetServerConnection()->GetScene();
-			scene_snapshots[scene].read_state(message, scene);
-
-			// Perform client side prediction
-			predict();
+			// A whole state supersedes the chunks applied so far, replay them first
+			finish_chunk_replay();
+			TraceScope trace("receive_state");
+			snapshot_bytes->record(static_cast<float>(message.GetSize()));
+			// read last input, server tick and clock sync
+			read_state_header(message);
+			trace.arg("tick", state_tick);
+			trace.arg("input", server_id);
+			// reconstruct state snapshot
+			if (read_snapshot(message))
+				apply_state();
+			break;
+		}
 
+		case MSG_CSP_STATE_CHUNK:
+		{
+			URHO3D_LOGDEBUG("MSG_CSP_STATE_CHUNK");
+			TraceScope trace("receive_state_chunk");
+			snapshot_bytes->record(static_cast<float>(message.GetSize()));
+			read_state_header(message);
+			trace.arg("tick", state_tick);
+			trace.arg("input", server_id);
+			// Each chunk is applied as it arrives, and replayed once per snapshot
+			if (read_chunk(message))
+				apply_chunk();
 			break;
 		}
+		}
+	}
+}
+
+void CSP_Client::apply_state()
+{
+	begin_reconcile();
+	// rewind the rest of the world to the same tick
+	const auto rewound = rewind();
+	read_received_state();
+
+	// Perform client side prediction
+	predict(rewound);
+}
+
+void CSP_Client::apply_chunk()
+{
+	// Without a history to keep the corrections in, each chunk is reconciled on its own
+	if (!rewind_physics)
+	{
+		apply_state();
+		return;
+	}
+
+	// A chunk of a newer snapshot, replay the previous one's chunks first so their corrections carry over
+	if (chunk_replay_pending && chunk_snapshot_id != snapshot_chunks.get_snapshot_id())
+		finish_chunk_replay();
+
+	// The first chunk collects the bodies to replay and the predicted positions, from the latest prediction
+	if (!chunk_replay_pending)
+	{
+		begin_reconcile();
+		chunk_mismatch = false;
 	}
+
+	if (!rewind())
+	{
+		// Too old for the history, there's nothing to keep the corrections in
+		chunk_replay_pending = false;
+		read_received_state();
+		predict(false);
+		return;
+	}
+
+	read_received_state();
+
+	auto physicsWorld = get_scene()->GetComponent<PhysicsWorld>();
+	if (!skip_matching_replay || !physics_history.matches(server_id, physicsWorld, prediction_tolerance, get_replay_bodies()))
+		chunk_mismatch = true;
+
+	// Keep the corrected state, the next chunks rewind to it and the replay starts from it
+	if (selective_replay)
+		physics_history.update(server_id, replay_set.get_bodies());
+	else
+		physics_history.save(server_id, physicsWorld);
+
+	// Back to the latest prediction until the snapshot is replayed
+	physics_history.restore(id, physicsWorld, get_replay_bodies());
+
+	chunk_replay_pending = true;
+	chunk_snapshot_id = snapshot_chunks.get_snapshot_id();
+	chunk_server_id = server_id;
+
+	if (snapshot_chunks.is_complete())
+		finish_chunk_replay();
 }
 
-void CSP_Client::send_input(Controls & controls)
+void CSP_Client::finish_chunk_replay()
 {
-	auto server_connection = GetSubsystem<Network>()->GetServerConnection();
-	if (!server_connection ||
-		!server_connection->GetScene() ||
-		!server_connection->IsSceneLoaded())
+	if (!chunk_replay_pending)
 		return;
+	chunk_replay_pending = false;
+
+	// Replay from the tick the chunks were applied at, a newer chunk's header may have moved server_id on
+	const auto newest_server_id = server_id;
+	server_id = chunk_server_id;
+
+	if (!chunk_mismatch)
+	{
+		// Every chunk matched the prediction, the world is already at the latest prediction
+		remove_obsolete_history();
+		++prediction_hits;
+		prediction_hits_metric->add();
+	}
+	else
+		predict(rewind(), false);
+
+	server_id = newest_server_id;
+}
+
+void CSP_Client::begin_reconcile()
+{
+	// collect the bodies to replay, from their latest state
+	if (selective_replay)
+		replay_set.collect(get_scene()->GetComponent<PhysicsWorld>(), int(id - server_id) * timestep);
+	// remember where the predicted nodes are, in case the replay gets snapped
+	predicted_positions.Clear();
+	for (auto& node : replay_set.get_nodes())
+	{
+		if (node)
+			predicted_positions[node->GetID()] = node->GetWorldPosition();
+	}
+}
+
+void CSP_Client::read_received_state()
+{
+	auto scene = get_scene();
+
+	// read state snapshot
+	HiresTimer decode_timer;
+	MemoryBuffer state(received_state);
+	switch (state.ReadUByte())
+	{
+	case SNAPSHOT_QUANTIZED:
+		if (!scene_quantized_snapshots[scene].read_state(state, scene, quantization, &interpolation, state_tick))
+			URHO3D_LOGWARNING("Received malformed quantized state snapshot");
+		break;
+	case SNAPSHOT_SCHEMA:
+		if (!state_schema)
+			URHO3D_LOGWARNING("Received schema state snapshot without a state schema");
+		else if (!state_schema->read_state(state, scene, quantization))
+			URHO3D_LOGWARNING("Received malformed schema state snapshot");
+		break;
+	default:
+		scene_snapshots[scene].read_state(state, scene);
+		break;
+	}
+	snapshot_decode_time += decode_timer.GetUSec(false) / 1000000.f;
+}
+
+void CSP_Client::HandleServerConnected(StringHash eventType, VariantMap& eventData)
+{
+	reset();
+}
+
+void CSP_Client::reset()
+{
+	// Snapshot IDs start over with a new server
+	snapshot_ack = 0;
+	server_tick = 0;
+	clock_sync.clear();
+	clock_base_tick = 0;
+	interpolation.clear();
+	dilation = 0;
+	if (time_dilation && get_scene())
+		get_scene()->SetTimeScale(1.f);
+	snapshot_history.clear();
+	snapshot_chunks.clear();
+	physics_history.clear();
+	replay_pending = false;
+	replay_restarts = 0;
+	chunk_replay_pending = false;
+	visual_offsets.Clear();
+}
+
+void CSP_Client::HandlePhysicsPreStep(StringHash eventType, VariantMap& eventData)
+{
+	step_timer.Reset();
+}
+
+void CSP_Client::HandlePhysicsPostStep(StringHash eventType, VariantMap& eventData)
+{
+	// Both live and replayed steps tell how long a replayed step takes
+	const auto step_time = step_timer.GetUSec(false) / 1000000.f;
+	step_cost = step_cost > 0 ? Lerp(step_cost, step_time, 0.1f) : step_time;
+
+	// Replayed ticks are saved by reapply_inputs()
+	if (!rewind_physics || prediction_input != nullptr)
+		return;
+
+	auto scene = get_scene();
+	if (!scene)
+		return;
+
+	using namespace PhysicsPostStep;
+	auto physicsWorld = static_cast<PhysicsWorld*>(eventData[P_WORLD].GetPtr());
+	if (physicsWorld->GetScene() != scene)
+		return;
+
+	// The state after applying the latest input
+	physics_history.save(id, physicsWorld);
+}
+
+void CSP_Client::HandleSceneUpdate(StringHash eventType, VariantMap& eventData)
+{
+	auto scene = get_scene();
+	if (!scene)
+		return;
+
+	using namespace SceneUpdate;
+	if (eventData[P_SCENE].GetPtr() != scene)
+		return;
+
+	// Fade the visual error, before this frame's physics steps
+	const auto decay = std::exp(-visual_error_decay * eventData[P_TIMESTEP].GetFloat());
+	for (auto it = visual_offsets.Begin(); it != visual_offsets.End();)
+	{
+		it->second_ *= decay;
+		if (it->second_.LengthSquared() < M_EPSILON)
+			it = visual_offsets.Erase(it);
+		else
+			++it;
+	}
+
+	bind_metrics();
+
+	// Chunks of a snapshot which didn't arrive whole, replayed once per frame at most
+	finish_chunk_replay();
+
+	// At least one step per frame, so the replay catches up even when over budget
+	if (replay_pending)
+		continue_replay(Max(get_budget_steps(), 1u));
+
+	// Kinematic bodies follow their nodes in this frame's physics steps
+	if (!interpolation.empty())
+	{
+		ID render_tick;
+		float render_fraction;
+		get_render_tick(render_tick, render_fraction);
+		interpolation.update(render_tick, render_fraction, timestep);
+		interpolation_extrapolations->set(static_cast<float>(interpolation.extrapolations));
+		interpolation_underruns->set(static_cast<float>(interpolation.underruns));
+	}
+}
+
+Scene* CSP_Client::get_scene() const
+{
+	auto server = transport->get_server();
+	return server ? transport->get_scene(server) : nullptr;
+}
+
+void CSP_Client::send_input(const InputRecord & input)
+{
+	TraceScope trace("send_input");
+	trace.arg("input", input.id);
+
+	auto server = transport->get_server();
+	if (!server ||
+		!transport->get_scene(server) ||
+		!transport->is_scene_loaded(server))
+		return;
+
+	// Inputs since the last one the server acknowledged, newest first. The new input is the newest buffered one.
+	unsigned count = 1;
+	if (redundant_inputs)
+	{
+		const auto max_count = Clamp(max_redundant_inputs, 1u, 255u);
+		while (count < input_buffer.size() &&
+			count < max_count &&
+			int(input_buffer[input_buffer.size() - 1 - count].id - server_id) > 0)
+			++count;
+	}
 
 	input_message.Clear();
-	input_message.WriteUInt(controls.buttons_);
-	input_message.WriteFloat(controls.yaw_);
-	input_message.WriteFloat(controls.pitch_);
-	input_message.WriteVariantMap(controls.extraData_);
+	// Acknowledge the newest snapshot so the server can use it as delta baseline
+	input_message.WriteUInt(snapshot_ack);
+	// Echoed back for the round trip time
+	input_message.WriteFloat(GetSubsystem<Time>()->GetElapsedTime());
+	// For the server's lag compensation, remote nodes are seen where they were at the render time.
+	// The whole tick and the fraction are sent apart, a float tick loses whole ticks on long running servers.
+	ID view_tick = server_tick;
+	float view_fraction = 0.f;
+	if (!interpolation.empty())
+		get_render_tick(view_tick, view_fraction);
+	input_message.WriteUInt(view_tick);
+	input_message.WriteUByte(static_cast<unsigned char>(Min(static_cast<unsigned>(view_fraction * 256.f), 255u)));
+	input_message.WriteUByte(count);
+	input.write(input_message);
+	// Older inputs, each delta coded against the following one
+	for (unsigned i = 1; i < count; ++i)
+	{
+		const auto newer = input_buffer.size() - i;
+		input_buffer[newer - 1].write_delta(input_message, input_buffer[newer]);
+	}
 
 	// No access, and currently no use for position optimization
 	/*if (sendMode_ >= OPSM_POSITION)
@@ -91,8 +441,14 @@ void CSP_Client::send_input(Controls & controls)
 	if (sendMode_ >= OPSM_POSITION_ROTATION)
 	input_message.WritePackedQuaternion(rotation_);*/
 
-	//server_connection->SendMessage(MSG_CSP_INPUT, false, false, input_message);
-	server_connection->SendMessage(MSG_CSP_INPUT, true, true, input_message);
+	transport->send(server, MSG_CSP_INPUT, !redundant_inputs, input_message);
+}
+
+void CSP_Client::read_state_header(MemoryBuffer & message)
+{
+	read_last_id(message);
+	read_server_tick(message);
+	read_clock_sync(message);
 }
 
 void CSP_Client::read_last_id(MemoryBuffer & message)
@@ -115,55 +471,359 @@ void CSP_Client::read_last_id(MemoryBuffer & message)
 	URHO3D_LOGDEBUG("server_id: " + String(server_id));
 }
 
-void CSP_Client::predict()
+void CSP_Client::read_server_tick(MemoryBuffer & message)
+{
+	const auto new_server_tick = message.ReadUInt();
+	state_tick = new_server_tick;
+
+	// States are sent unordered. Handle range looping correctly
+	if (int(new_server_tick - server_tick) > 0)
+		server_tick = new_server_tick;
+}
+
+void CSP_Client::read_clock_sync(MemoryBuffer & message)
+{
+	const auto send_time = message.ReadFloat();
+	const auto hold_time = message.ReadFloat();
+	const auto input_depth = message.ReadUByte();
+	const auto target_depth = message.ReadUByte();
+
+	// No input echoed yet. The sample is taken at this state's tick, which may be older than the newest one.
+	if (send_time > 0.f)
+	{
+		// Server time counts from the first sampled tick, so it keeps its precision however long the server runs
+		if (!clock_sync.has_samples())
+			clock_base_tick = state_tick;
+		clock_sync.add_sample(send_time, GetSubsystem<Time>()->GetElapsedTime(), hold_time, int(state_tick - clock_base_tick) * timestep);
+		rtt_ms->record(clock_sync.get_rtt() * 1000.f);
+	}
+
+	// A reordered older state carries outdated buffer depths
+	if (state_tick != server_tick)
+		return;
+	server_input_depth = input_depth;
+	server_target_depth = target_depth;
+
+	if (!time_dilation)
+		return;
+
+	// Too many buffered inputs means the inputs arrive earlier than needed, slow down. Too few, speed up.
+	const auto error = static_cast<float>(server_input_depth) - static_cast<float>(server_target_depth + input_lead_margin);
+	const auto target_dilation = Clamp(-error * time_dilation_gain, -max_time_dilation, max_time_dilation);
+	dilation = Lerp(dilation, target_dilation, 0.1f);
+
+	get_scene()->SetTimeScale(1.f + dilation);
+	time_dilation_metric->set(dilation);
+}
+
+bool CSP_Client::read_snapshot(MemoryBuffer & message)
+{
+	HiresTimer decode_timer;
+
+	const auto new_snapshot_id = message.ReadUInt();
+	const auto baseline_id = message.ReadUInt();
+
+	// Snapshots are sent unordered, ignore older ones. Handle range looping correctly
+	if (snapshot_ack != 0 && int(new_snapshot_id - snapshot_ack) <= 0)
+		return false;
+
+	if (baseline_id == 0)
+	{
+		// Full state
+		const auto size = message.GetSize() - message.GetPosition();
+		received_state.Resize(size);
+		message.Read(received_state.Buffer(), size);
+	}
+	else
+	{
+		auto baseline = snapshot_history.get(baseline_id);
+		if (!baseline)
+		{
+			URHO3D_LOGDEBUG("missing baseline: " + String(baseline_id));
+			return false;
+		}
+		if (!read_delta(message, *baseline, received_state))
+		{
+			URHO3D_LOGWARNING("Received malformed state snapshot delta");
+			return false;
+		}
+	}
+
+	snapshot_ack = new_snapshot_id;
+	snapshot_history.add(snapshot_ack, received_state);
+
+	snapshot_decode_time += decode_timer.GetUSec(false) / 1000000.f;
+	return true;
+}
+
+bool CSP_Client::read_chunk(MemoryBuffer & message)
+{
+	const auto chunk_snapshot_id = message.ReadUInt();
+	const auto index = message.ReadUByte();
+	const auto count = message.ReadUByte();
+	const auto first_node_id = message.ReadUInt();
+	const auto last_node_id = message.ReadUInt();
+
+	// Ignore chunks of older snapshots, the rest of the current one's chunks are fine. Handle range looping correctly
+	if (snapshot_ack != 0 && int(chunk_snapshot_id - snapshot_ack) < 0)
+		return false;
+	if (!snapshot_chunks.receive(chunk_snapshot_id, index, count, first_node_id, last_node_id))
+		return false;
+
+	// Not used as a delta baseline, the server doesn't keep chunked snapshots
+	snapshot_ack = chunk_snapshot_id;
+
+	const auto size = message.GetSize() - message.GetPosition();
+	received_state.Resize(size);
+	message.Read(received_state.Buffer(), size);
+
+	chunked_complete->set(static_cast<float>(snapshot_chunks.complete_snapshots));
+	chunked_partial->set(static_cast<float>(snapshot_chunks.partial_snapshots));
+
+	return true;
+}
+
+bool CSP_Client::rewind()
+{
+	if (!rewind_physics)
+		return false;
+
+	auto scene = get_scene();
+	auto physicsWorld = scene->GetComponent<PhysicsWorld>();
+
+	if (!physics_history.restore(server_id, physicsWorld, get_replay_bodies()))
+	{
+		URHO3D_LOGDEBUG("server tick isn't in the physics history: " + String(server_id));
+		return false;
+	}
+
+	return true;
+}
+
+void CSP_Client::predict(bool rewound, bool may_match)
 {
 	URHO3D_LOGDEBUG("remove_obsolete_history");
 	remove_obsolete_history();
-	URHO3D_LOGDEBUG("reapply_inputs");
-	reapply_inputs();
+
+	// A state applied to the live world replaces the one a pending replay started from
+	if (!rewound)
+		replay_pending = false;
+
+	// A pending replay which got past the server's tick already replaced its prediction with a corrected one.
+	// Handle range looping correctly
+	const auto replayed_past = replay_pending && int(replay_cursor - server_id) >= 0;
+
+	// If the server agrees with the prediction for its tick, return to the latest predicted state instead of replaying.
+	// A pending replay keeps going, its corrected history still holds.
+	if (rewound && may_match && skip_matching_replay && (!replay_pending || replayed_past))
+	{
+		auto physicsWorld = get_scene()->GetComponent<PhysicsWorld>();
+		if (physics_history.matches(server_id, physicsWorld, prediction_tolerance, get_replay_bodies()) &&
+			physics_history.restore(id, physicsWorld, get_replay_bodies()))
+		{
+			++prediction_hits;
+			prediction_hits_metric->add();
+			return;
+		}
+	}
+
+	++prediction_misses;
+	prediction_misses_metric->add();
+
+	// The new server state replaces the one a pending replay started from
+	replay_pending = false;
+
+	// Inputs are tagged with consecutive IDs
+	const auto steps = static_cast<unsigned>(Max(int(id - server_id), 0));
+	if (steps <= get_budget_steps())
+	{
+		++replays_immediate;
+		replays_immediate_metric->add();
+
+		URHO3D_LOGDEBUG("reapply_inputs");
+		replay_restarts = 0;
+		reapply_inputs(server_id);
+		return;
+	}
+
+	// Restarting a replay behind its cursor loses its progress, so one which keeps restarting never catches up
+	if (replayed_past)
+		++replay_restarts;
+
+	// Spreading continues from the history, so it needs the rewound state
+	if (replay_fallback == REPLAY_SPREAD && rewound && replay_restarts <= max_replay_restarts)
+	{
+		++replays_spread;
+		replays_spread_metric->add();
+
+		// Save the corrected state to continue from, the live steps go on from the latest prediction meanwhile
+		auto physicsWorld = get_scene()->GetComponent<PhysicsWorld>();
+		if (selective_replay)
+			physics_history.update(server_id, replay_set.get_bodies());
+		else
+			physics_history.save(server_id, physicsWorld);
+
+		replay_pending = true;
+		replay_cursor = server_id;
+		continue_replay(get_budget_steps());
+		return;
+	}
+
+	snap();
 }
 
-void CSP_Client::reapply_inputs()
+CSP_Client::ID CSP_Client::reapply_inputs(ID from, unsigned max_steps)
 {
-	GetSubsystem<DebugHud>()->SetAppStats("reapply_inputs() input_buffer.size(): ", input_buffer.size());
+	TraceScope trace("reapply_inputs");
+	trace.arg("tick", server_tick);
+	trace.arg("from_input", from);
 
-	auto scene = GetSubsystem<Network>()->GetServerConnection()->GetScene();
+	HiresTimer replay_timer;
+	ID last = from;
+	unsigned steps = 0;
+
+	auto scene = get_scene();
 
 	auto physicsWorld = scene->GetComponent<PhysicsWorld>();
 
-	for (auto& controls : input_buffer)
+	// Keep the rest of the world in its latest state
+	if (selective_replay)
+		replay_set.freeze(physicsWorld);
+
+	for (unsigned i = 0; i < input_buffer.size() && steps < max_steps; ++i)
 	{
-		prediction_controls = &controls;
+		auto& input = input_buffer[i];
+		prediction_input = &input;
 
-		if (unsigned(controls.extraData_["id"].GetUInt()) > server_id) {
-			URHO3D_LOGDEBUG("reapply id: " + String(controls.extraData_["id"].GetUInt()));
-			//apply_local_input(controls, timestep);
+		// Handle range looping correctly
+		if (int(input.id - from) > 0) {
+			URHO3D_LOGDEBUG("reapply id: " + String(input.id));
+			TraceScope step_trace("replay_step");
+			// The tick this step replays, the server applied server_id at server_tick
+			step_trace.arg("tick", static_cast<long long>(server_tick + (input.id - server_id)));
+			step_trace.arg("input", input.id);
+			//apply_local_input(input, timestep);
 			physicsWorld->Update(timestep);
+
+			// Frozen bodies keep the state saved when the tick was predicted
+			if (selective_replay)
+				physics_history.update(input.id, replay_set.get_bodies());
+			else if (rewind_physics)
+				physics_history.save(input.id, physicsWorld);
+
+			last = input.id;
+			++steps;
 		}
 	}
 
-	prediction_controls = nullptr;
+	prediction_input = nullptr;
+
+	if (selective_replay)
+		replay_set.unfreeze();
+
+	const auto elapsed = replay_timer.GetUSec(false) / 1000000.f;
+	frame_replay_time += elapsed;
+	replay_time += elapsed;
+	replay_depth->record(static_cast<float>(steps));
+	replay_ms->record(elapsed * 1000.f);
+	return last;
+}
+
+unsigned CSP_Client::get_budget_steps()
+{
+	if (replay_budget <= 0.f)
+		return M_MAX_UNSIGNED;
+
+	// The budget is per frame, however many snapshots arrive in it
+	const auto frame = GetSubsystem<Time>()->GetFrameNumber();
+	if (frame != replay_frame)
+	{
+		replay_frame = frame;
+		frame_replay_time = 0;
+	}
+
+	const auto time_left = replay_budget - frame_replay_time;
+	if (time_left <= 0.f)
+		return 0;
+	// Nothing measured yet
+	if (step_cost <= 0.f)
+		return M_MAX_UNSIGNED;
+
+	return static_cast<unsigned>(time_left / step_cost);
+}
+
+void CSP_Client::continue_replay(unsigned steps)
+{
+	if (steps == 0)
+		return;
+
+	auto physicsWorld = get_scene()->GetComponent<PhysicsWorld>();
+
+	// Replay from the corrected state of the last replayed tick
+	if (!physics_history.restore(replay_cursor, physicsWorld, get_replay_bodies()))
+	{
+		URHO3D_LOGDEBUG("spread replay tick isn't in the physics history: " + String(replay_cursor));
+		replay_pending = false;
+		return;
+	}
+
+	replay_cursor = reapply_inputs(replay_cursor, steps);
+
+	// Caught up, the replayed state is the new prediction
+	if (replay_cursor == id)
+	{
+		replay_pending = false;
+		replay_restarts = 0;
+		return;
+	}
+
+	// Back to the latest prediction until the next part
+	physics_history.restore(id, physicsWorld, get_replay_bodies());
+}
+
+void CSP_Client::snap()
+{
+	++replays_snapped;
+	replays_snapped_metric->add();
+	replay_restarts = 0;
+
+	// The world stays in the server's state, show the predicted nodes where they were and let the offset fade
+	for (auto& node : replay_set.get_nodes())
+	{
+		if (!node)
+			continue;
+
+		auto it = predicted_positions.Find(node->GetID());
+		if (it != predicted_positions.End())
+			visual_offsets[node->GetID()] += it->second_ - node->GetWorldPosition();
+	}
+
+	// The history still holds the dropped predictions for the ticks after the server's,
+	// the snapped state replaces them so later snapshots are checked and replayed against it
+	if (!rewind_physics)
+		return;
+
+	// Only the ticks still within the history's capacity
+	auto first = server_id + 1;
+	const auto capacity = physics_history.get_tick_capacity();
+	// Handle range looping correctly
+	if (int(id - first) >= static_cast<int>(capacity))
+		first = id - capacity + 1;
+
+	auto physicsWorld = get_scene()->GetComponent<PhysicsWorld>();
+	for (auto tick = first; int(id - tick) >= 0; ++tick)
+	{
+		if (selective_replay)
+			physics_history.update(tick, replay_set.get_bodies());
+		else
+			physics_history.save(tick, physicsWorld);
+	}
 }
 
 void CSP_Client::remove_obsolete_history()
 {
-	input_buffer.erase(
-		std::remove_if(input_buffer.begin(), input_buffer.end(), [&](Controls& controls) {
-			unsigned update_id = controls.extraData_["id"].GetUInt();
-			// Handle value range looping correctly
-			if (id >= server_id)
-			{
-				if (update_id <= server_id ||
-					update_id > id)
-					return true;
-			}
-			else
-			{
-				if (update_id >= server_id ||
-					update_id < id)
-					return true;
-			}
-			return false;
-		}),
-		input_buffer.end());
+	TraceScope trace("remove_obsolete_history");
+	trace.arg("input", server_id);
+
+	input_buffer.remove_until(server_id);
 }
@@ -1,15 +1,24 @@
 #pragma once
 
+#include "CSP_ClockSync.h"
+#include "CSP_Delta.h"
+#include "CSP_Input.h"
+#include "CSP_Metrics.h"
 #include "CSP_messages.h"
+#include "CSP_PhysicsHistory.h"
+#include "CSP_QuantizedSnapshot.h"
+#include "CSP_Schema.h"
+#include "CSP_SelectiveReplay.h"
+#include "CSP_SnapshotChunks.h"
+#include "CSP_Transport.h"
 #include "StateSnapshot.h"
 #include <Urho3D/Core/Object.h>
-#include <vector>
+#include <Urho3D/Core/Timer.h>
+#include <memory>
 
 namespace Urho3D
 {
 	class Context;
-	class Controls;
-	class Connection;
 	class MemoryBuffer;
 }
 
@@ -21,6 +30,7 @@ Client side prediction client.
 
 - sends input to server
 - receive state snapshot from server and run prediction
+- keep a history of the physics world to rewind it to the server's tick before replaying inputs
 */
 struct CSP_Client : Object
 {
@@ -37,39 +47,256 @@ struct CSP_Client : Object
 	// Fixed timestep length
 	float timestep = 0;
 
-	Controls* prediction_controls = nullptr;
+	// Quantized snapshot precision, must match the server's
+	QuantizationSettings quantization;
+	// Replicated fields of the quantized snapshots, must match the server's.
+	// Schema states are applied directly, the interpolation buffer only takes the default quantized states.
+	std::shared_ptr<const StateSerializer> state_schema;
 
-	// Tags the input with "id" extraData, adds it to the input buffer, and sends it to the server.
-	void add_input(Controls& input);
+	// Rewind the whole physics world to the server's tick before replaying inputs, instead of replaying on top of the latest state
+	bool rewind_physics = true;
+	// Physics world state after each input, defaults to 64 ticks of up to 256 dynamic bodies
+	PhysicsHistory physics_history;
+
+	// Skip replaying inputs when the server's state matches the predicted state of its tick, requires rewind_physics
+	bool skip_matching_replay = true;
+	// How close the predicted state has to be to the server's state to skip the replay
+	StateTolerance prediction_tolerance;
+	// Snapshots that matched the prediction and ones that needed a replay
+	unsigned prediction_hits = 0;
+	unsigned prediction_misses = 0;
+
+	// Replay only the locally predicted nodes and the bodies they interact with, freezing the rest of the world
+	bool selective_replay = false;
+	// Locally predicted nodes and the bodies collected for each replay
+	SelectiveReplay replay_set;
+	// Add a locally controlled node for selective replay and snap blending
+	void add_predicted_node(Node* node) { replay_set.add_node(node); }
+
+	// Remote nodes shown a delay in the past between buffered states, instead of snapping to each state. Quantized snapshots only.
+	InterpolationBuffer interpolation;
+	// Add a remote node to interpolate, its rigid body should be kinematic. Locally predicted nodes shouldn't be added.
+	void add_interpolated_node(Node* node) { interpolation.add_node(node); }
+	// Server time the interpolated nodes are shown at, in seconds since get_clock_base_tick()
+	float get_render_time() const;
+	// Server tick and fraction of a tick the interpolated nodes are shown at
+	void get_render_tick(ID& tick, float& fraction) const;
+	// Server tick the clock sync's server times count from
+	ID get_clock_base_tick() const { return clock_base_tick; }
+
+	// Per-frame time budget for replaying inputs in seconds, 0 for no limit
+	float replay_budget = 0;
+	// What to do with a replay that doesn't fit the budget
+	enum ReplayFallback
+	{
+		// Replay part of the inputs each frame, the latest prediction stays in place until the replay catches up
+		REPLAY_SPREAD,
+		// Keep the server's state without replaying, and blend the predicted nodes' visual error away
+		REPLAY_SNAP
+	};
+	ReplayFallback replay_fallback = REPLAY_SPREAD;
+	// Snap instead of spreading once a spread replay had to restart behind its progress this many times in a row,
+	// which happens when the budget covers fewer steps than the inputs added between snapshots
+	unsigned max_replay_restarts = 3;
+	// How fast the visual error left by a snap fades, per second
+	float visual_error_decay = 10.f;
+	// Replays done within the budget, spread over frames, and snapped
+	unsigned replays_immediate = 0;
+	unsigned replays_spread = 0;
+	unsigned replays_snapped = 0;
+
+	// Offset from a predicted node's position to where it's shown, left by snapping. Add it to the node's visuals.
+	Vector3 get_visual_offset(Node* node) const;
+	// Received chunks of the newest chunked snapshot and chunked snapshot completeness counters
+	const SnapshotChunks& get_snapshot_chunks() const { return snapshot_chunks; }
+
+	// A spread replay didn't catch up with the latest input yet
+	bool is_replay_pending() const { return replay_pending; }
+
+	// Send inputs unreliably, each message repeating the inputs since the last one the server acknowledged.
+	// Otherwise each input is sent once, reliable and in order.
+	bool redundant_inputs = true;
+	// Maximum number of inputs per message in redundant mode
+	unsigned max_redundant_inputs = 16;
+
+	// Server tick of the newest state snapshot, the tick being reconciled against
+	ID get_server_tick() const { return server_tick; }
+
+	// Round trip time and server clock estimates
+	const ClockSync& get_clock_sync() const { return clock_sync; }
+	// Estimated ticks between sampling an input and the server applying it: half the round trip plus the server's input buffer depth
+	float get_input_lead() const;
+
+	// Speed up or slow down the scene slightly so the server's buffer of this client's inputs stays at its target depth.
+	// Keeps the inputs as late as possible without starving the server. Changes the scene's time scale.
+	bool time_dilation = false;
+	// Inputs to keep buffered on the server on top of its target depth
+	unsigned input_lead_margin = 0;
+	// Largest change of the simulation rate
+	float max_time_dilation = 0.05f;
+	// Simulation rate change per input of buffer depth error
+	float time_dilation_gain = 0.01f;
+	// Current simulation rate change
+	float get_time_dilation() const { return dilation; }
+
+	// The input being replayed, nullptr when not replaying
+	InputRecord* prediction_input = nullptr;
+
+	// Tags the input with an ID, adds it to the input buffer, and sends it to the server.
+	void add_input(InputRecord& input);
+
+	// Where the messages go, Urho's Network by default
+	SharedPtr<CSP_Transport> transport;
+	// Handle a message received from the server through the transport
+	void receive_message(int message_id, MemoryBuffer& message);
+	// Forget the previous server's state, when connecting to a server
+	void reset();
+
+	// Seconds spent reading state snapshots, and replaying inputs, for profiling
+	float snapshot_decode_time = 0;
+	float replay_time = 0;
+
+	// Counters, gauges and histograms of the client, can be shared with a server and other clients
+	SharedPtr<MetricsRegistry> metrics;
 	
 protected:
 	// current client-side update ID
 	ID id = 0;
 	// The current recieved ID from the server
 	ID server_id = -1;
+	// Server tick of the newest state snapshot
+	ID server_tick = 0;
+	// Server tick of the state being read
+	ID state_tick = 0;
+
+	ClockSync clock_sync;
+	// Server tick of the first clock sample, server times are counted from it
+	ID clock_base_tick = 0;
+	// The server's buffer of this client's inputs, as of the newest state
+	unsigned server_input_depth = 0;
+	unsigned server_target_depth = 0;
+	float dilation = 0;
 
-	// Input buffer
-	std::vector<Controls> input_buffer;
+	// Inputs not yet acknowledged by the server
+	InputBuffer input_buffer;
 	// Reusable message buffer
 	VectorBuffer input_message;
 
 	HashMap<Scene*, StateSnapshot> scene_snapshots;
+	HashMap<Scene*, QuantizedSnapshot> scene_quantized_snapshots;
+
+	// Newest received snapshot ID, acknowledged to the server with each input
+	ID snapshot_ack = 0;
+	// Received snapshots, used as delta baselines
+	SnapshotHistory snapshot_history;
+	// Received chunks of the newest chunked snapshot
+	SnapshotChunks snapshot_chunks;
+	// Reusable reconstructed state buffer
+	PODVector<unsigned char> received_state;
+
+	// Smoothed duration of a physics step in seconds, used to fit replays in the budget
+	float step_cost = 0;
+	HiresTimer step_timer;
+	// Time spent replaying during the current frame
+	float frame_replay_time = 0;
+	unsigned replay_frame = 0;
+
+	// Spread replay in progress, continuing from the corrected state saved for replay_cursor
+	bool replay_pending = false;
+	ID replay_cursor = 0;
+	// Spread replays restarted behind their cursor since one last caught up
+	unsigned replay_restarts = 0;
+
+	// Chunks applied to the history at chunk_server_id and not replayed yet, and whether any differed from the prediction
+	bool chunk_replay_pending = false;
+	bool chunk_mismatch = false;
+	ID chunk_snapshot_id = 0;
+	ID chunk_server_id = 0;
+
+	// Predicted nodes' positions before the rewind, and visual offsets left by snapping, by node ID
+	HashMap<unsigned, Vector3> predicted_positions;
+	HashMap<unsigned, Vector3> visual_offsets;
+
+	// Registry the metrics below were created in, kept alive while they're used
+	SharedPtr<MetricsRegistry> bound_metrics;
+	MetricGauge* input_buffer_size = nullptr;
+	MetricHistogram* snapshot_bytes = nullptr;
+	MetricHistogram* rtt_ms = nullptr;
+	MetricHistogram* replay_depth = nullptr;
+	MetricHistogram* replay_ms = nullptr;
+	MetricCounter* prediction_hits_metric = nullptr;
+	MetricCounter* prediction_misses_metric = nullptr;
+	MetricCounter* replays_immediate_metric = nullptr;
+	MetricCounter* replays_spread_metric = nullptr;
+	MetricCounter* replays_snapped_metric = nullptr;
+	MetricGauge* time_dilation_metric = nullptr;
+	MetricGauge* chunked_complete = nullptr;
+	MetricGauge* chunked_partial = nullptr;
+	MetricGauge* interpolation_extrapolations = nullptr;
+	MetricGauge* interpolation_underruns = nullptr;
 
 
 	// Handle custom network messages
 	void HandleNetworkMessage(StringHash eventType, VariantMap& eventData);
+	// Reset the snapshot state for the new server
+	void HandleServerConnected(StringHash eventType, VariantMap& eventData);
+	// Scene replicated from the server, nullptr when not connected
+	Scene* get_scene() const;
+	// Create the metrics in the current registry, if it was replaced
+	void bind_metrics();
+	// Start timing a physics step
+	void HandlePhysicsPreStep(StringHash eventType, VariantMap& eventData);
+	// Save the physics world state after each predicted tick
+	void HandlePhysicsPostStep(StringHash eventType, VariantMap& eventData);
+	// Continue a spread replay, fade the visual error and place the interpolated nodes
+	void HandleSceneUpdate(StringHash eventType, VariantMap& eventData);
 
 	// Sends the client's input to the server
-	void send_input(Controls& controls);
+	void send_input(const InputRecord& input);
+	// read the header of state messages and chunks
+	void read_state_header(MemoryBuffer& message);
 	// read server's last received ID
 	void read_last_id(MemoryBuffer& message);
+	// read the server tick of the state
+	void read_server_tick(MemoryBuffer& message);
+	// read the echoed timestamp and the server's input buffer depth, and update the clock and the time dilation
+	void read_clock_sync(MemoryBuffer& message);
+	// Reconstruct the state snapshot into received_state. Returns false if it's out of date or its baseline is missing.
+	bool read_snapshot(MemoryBuffer& message);
+	// Read a snapshot chunk into received_state. Returns false if it's out of date or a duplicate.
+	bool read_chunk(MemoryBuffer& message);
+	// Rewind to the server's tick, apply received_state, and predict from it
+	void apply_state();
+	// Rewind to the server's tick, apply a chunk from received_state and keep the corrected state in the history.
+	// The replay waits for the rest of the snapshot's chunks, or the next frame.
+	void apply_chunk();
+	// Replay the chunks applied since the last replay
+	void finish_chunk_replay();
+	// Collect the bodies to replay and the predicted nodes' positions, before rewinding
+	void begin_reconcile();
+	// Apply received_state to the scene
+	void read_received_state();
+
+
+	// Restore the physics world to its state after the server's last received input. Returns false if it isn't in the history.
+	bool rewind();
+
+	// Bodies to rewind and replay, nullptr for the whole world
+	const PODVector<btRigidBody*>* get_replay_bodies() const { return selective_replay ? &replay_set.get_bodies() : nullptr; }
 
+	// do client-side prediction. may_match is false when the state is already known to differ from the prediction.
+	void predict(bool rewound, bool may_match = true);
 
-	// do client-side prediction
-	void predict();
+	// Re-apply the inputs after a given ID, up to max_steps of them, to correct the current network state.
+	// Returns the ID of the last re-applied input, or from if there was none.
+	ID reapply_inputs(ID from, unsigned max_steps = M_MAX_UNSIGNED);
 
-	// Re-apply all the inputs since after the current server ID to the current ID to correct the current network state.
-	void reapply_inputs();
+	// Number of physics steps left in this frame's replay budget
+	unsigned get_budget_steps();
+	// Replay the next part of a spread replay and return to the latest prediction
+	void continue_replay(unsigned steps);
+	// Keep the server's state instead of replaying, leaving a visual offset on the predicted nodes
+	void snap();
 
 	// Remove all the elements in the buffer which are behind the server_id, including it since it was already applied.
 	void remove_obsolete_history();
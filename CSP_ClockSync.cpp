@@ -0,0 +1,40 @@
+#include "CSP_ClockSync.h"
+
+#include <Urho3D/Math/MathDefs.h>
+
+using namespace Urho3D;
+
+// Smoothing factors from RFC 6298
+static constexpr float RTT_SMOOTHING = 1.f / 8.f;
+static constexpr float RTT_VARIANCE_SMOOTHING = 1.f / 4.f;
+
+void ClockSync::add_sample(float send_time, float receive_time, float hold_time, float server_time)
+{
+	const auto sample = receive_time - send_time - hold_time;
+	if (sample < 0.f)
+		return;
+
+	// The state was sent about half a round trip ago
+	const auto offset_sample = server_time + sample * 0.5f - receive_time;
+
+	if (!has_sample)
+	{
+		rtt = sample;
+		rtt_variance = sample * 0.5f;
+		offset = offset_sample;
+		has_sample = true;
+		return;
+	}
+
+	rtt_variance += (Abs(sample - rtt) - rtt_variance) * RTT_VARIANCE_SMOOTHING;
+	rtt += (sample - rtt) * RTT_SMOOTHING;
+	offset += (offset_sample - offset) * RTT_SMOOTHING;
+}
+
+void ClockSync::clear()
+{
+	rtt = 0;
+	rtt_variance = 0;
+	offset = 0;
+	has_sample = false;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+
+/*
+Round trip time and server clock estimates, from client timestamps echoed by the server.
+
+The server echoes the client time of the newest input message it received with how long it held it,
+so a sample doesn't count the time between the input's arrival and the state being sent.
+Smoothed as in RFC 6298.
+*/
+struct ClockSync
+{
+	// Add a sample: client time the echoed input was sent, client time the state arrived,
+	// time the server held the timestamp, and server time of the state
+	void add_sample(float send_time, float receive_time, float hold_time, float server_time);
+	void clear();
+
+	bool has_samples() const { return has_sample; }
+	// Smoothed round trip time in seconds
+	float get_rtt() const { return rtt; }
+	// Smoothed round trip time deviation in seconds
+	float get_rtt_variance() const { return rtt_variance; }
+	// Estimated server time at a client time
+	float get_server_time(float client_time) const { return client_time + offset; }
+
+protected:
+	float rtt = 0;
+	float rtt_variance = 0;
+	// Server time minus client time
+	float offset = 0;
+	bool has_sample = false;
+};
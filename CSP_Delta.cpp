@@ -0,0 +1,108 @@
+#include "CSP_Delta.h"
+
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+
+// Shorter unchanged runs are cheaper to send as part of the changed bytes than as a new run
+static constexpr unsigned MIN_UNCHANGED_RUN = 3;
+
+void write_delta(VectorBuffer & dest, const PODVector<unsigned char>& baseline, const PODVector<unsigned char>& state)
+{
+	const auto size = state.Size();
+	const auto baseline_size = baseline.Size();
+
+	// Bytes past the end of the baseline are compared against zero
+	auto delta_at = [&](unsigned i) -> unsigned char {
+		return i < baseline_size ? state[i] ^ baseline[i] : state[i];
+	};
+
+	dest.WriteVLE(size);
+
+	unsigned i = 0;
+	while (i < size)
+	{
+		// Unchanged run
+		const auto unchanged_start = i;
+		while (i < size && delta_at(i) == 0)
+			++i;
+
+		// Changed run, ends before the next long enough unchanged run
+		const auto changed_start = i;
+		auto changed_end = i;
+		while (i < size)
+		{
+			if (delta_at(i) != 0)
+				changed_end = ++i;
+			else if (i + 1 - changed_end >= MIN_UNCHANGED_RUN)
+				break;
+			else
+				++i;
+		}
+		// Don't leave a short unchanged tail as its own run
+		if (i == size)
+			changed_end = size;
+
+		dest.WriteVLE(changed_start - unchanged_start);
+		dest.WriteVLE(changed_end - changed_start);
+		for (auto j = changed_start; j < changed_end; ++j)
+			dest.WriteUByte(delta_at(j));
+
+		i = changed_end;
+	}
+}
+
+bool read_delta(MemoryBuffer & source, const PODVector<unsigned char>& baseline, PODVector<unsigned char>& state)
+{
+	const auto size = source.ReadVLE();
+	const auto baseline_size = baseline.Size();
+
+	auto baseline_at = [&](unsigned i) -> unsigned char {
+		return i < baseline_size ? baseline[i] : 0;
+	};
+
+	state.Resize(size);
+
+	unsigned i = 0;
+	while (i < size)
+	{
+		if (source.IsEof())
+			return false;
+
+		const auto unchanged = source.ReadVLE();
+		const auto changed = source.ReadVLE();
+		if (unchanged > size - i ||
+			changed > size - i - unchanged ||
+			changed > source.GetSize() - source.GetPosition())
+			return false;
+
+		for (auto end = i + unchanged; i < end; ++i)
+			state[i] = baseline_at(i);
+		for (auto end = i + changed; i < end; ++i)
+			state[i] = source.ReadUByte() ^ baseline_at(i);
+	}
+
+	return true;
+}
+
+
+void SnapshotHistory::add(ID id, const PODVector<unsigned char>& state)
+{
+	const auto index = id % SIZE;
+	ids[index] = id;
+	// Reuses the slot's memory once it grew big enough
+	states[index] = state;
+}
+
+const PODVector<unsigned char>* SnapshotHistory::get(ID id) const
+{
+	const auto index = id % SIZE;
+	if (id == 0 || ids[index] != id)
+		return nullptr;
+	return &states[index];
+}
+
+void SnapshotHistory::clear()
+{
+	for (auto& id : ids)
+		id = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Urho3D/Container/Vector.h>
+
+namespace Urho3D
+{
+	class MemoryBuffer;
+	class VectorBuffer;
+}
+
+using namespace Urho3D;
+
+
+/*
+Byte level delta compression of state snapshots.
+
+The state is XORed against a baseline state the receiver already has,
+so unchanged bytes become zero and are skipped as runs.
+
+serialization structure:
+- state size (VLE)
+- until the end of the state:
+	- number of unchanged bytes (VLE)
+	- number of changed bytes (VLE)
+	- changed bytes XORed with the baseline
+*/
+// Write the delta of a state against a baseline
+void write_delta(VectorBuffer& dest, const PODVector<unsigned char>& baseline, const PODVector<unsigned char>& state);
+// Reconstruct a state from a baseline and a delta. Returns false if the delta is malformed.
+bool read_delta(MemoryBuffer& source, const PODVector<unsigned char>& baseline, PODVector<unsigned char>& state);
+
+
+/*
+Recent states indexed by snapshot ID, used as delta baselines.
+Snapshot ID 0 is reserved for "no baseline".
+*/
+struct SnapshotHistory
+{
+	using ID = unsigned;
+
+	// Number of snapshots kept
+	static constexpr unsigned SIZE = 32;
+
+	// Store a state, overwriting the snapshot that was SIZE IDs before it
+	void add(ID id, const PODVector<unsigned char>& state);
+	// Get a stored state, or nullptr if it isn't in the history anymore
+	const PODVector<unsigned char>* get(ID id) const;
+	// Forget all the stored states
+	void clear();
+
+protected:
+	ID ids[SIZE] = {};
+	PODVector<unsigned char> states[SIZE];
+};
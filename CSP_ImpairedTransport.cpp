@@ -0,0 +1,120 @@
+#include "CSP_ImpairedTransport.h"
+
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Math/MathDefs.h>
+#include <cstring>
+
+ImpairedTransport::ImpairedTransport(CSP_Transport * transport, const LinkProfile & profile, unsigned seed) :
+	profile(profile),
+	transport(transport),
+	random(seed)
+{
+}
+
+void ImpairedTransport::update(float time_step)
+{
+	transport->update(time_step);
+	time += time_step;
+
+	unsigned due = 0;
+	while (due < delayed.Size() && delayed[due].due <= time)
+	{
+		auto& message = delayed[due];
+		if (message.peer)
+			transport->send(message.peer, message.message_id, message.reliable, VectorBuffer(message.data));
+		++due;
+	}
+	delayed.Erase(0, due);
+}
+
+void ImpairedTransport::send(Object * peer, int message_id, bool reliable, const VectorBuffer & message)
+{
+	++messages_sent;
+
+	unsigned copies = 1;
+	if (!reliable)
+	{
+		// The link turns bad and recovers per message
+		if (burst)
+			burst = chance() >= profile.burst_end;
+		else
+			burst = chance() < profile.burst_start;
+
+		if (chance() < (burst ? profile.burst_loss : profile.loss))
+		{
+			++messages_lost;
+			return;
+		}
+
+		if (chance() < profile.duplication)
+		{
+			++messages_duplicated;
+			copies = 2;
+		}
+	}
+
+	for (unsigned copy = 0; copy < copies; ++copy)
+	{
+		auto delay = sample_delay();
+		if (!reliable && chance() < profile.reordering)
+		{
+			++messages_reordered;
+			delay += profile.reorder_delay;
+		}
+
+		auto due = time + delay;
+		if (reliable)
+		{
+			due = Max(due, last_reliable_due);
+			last_reliable_due = due;
+		}
+
+		// Nothing to wait for, whatever else is queued. update() already sent the queued messages due by now,
+		// and a reliable message is never due before the reliable ones queued ahead of it.
+		if (due <= time)
+		{
+			transport->send(peer, message_id, reliable, message);
+			continue;
+		}
+
+		// After the messages due at the same time, so equal delays keep the send order
+		unsigned i = delayed.Size();
+		while (i > 0 && delayed[i - 1].due > due)
+			--i;
+		delayed.Insert(i, DelayedMessage());
+		auto& delayed_message = delayed[i];
+		delayed_message.due = due;
+		delayed_message.peer = peer;
+		delayed_message.message_id = message_id;
+		delayed_message.reliable = reliable;
+		delayed_message.data.Resize(message.GetSize());
+		if (message.GetSize())
+			memcpy(&delayed_message.data[0], message.GetData(), message.GetSize());
+	}
+}
+
+float ImpairedTransport::chance()
+{
+	return std::uniform_real_distribution<float>(0.f, 1.f)(random);
+}
+
+float ImpairedTransport::sample_delay()
+{
+	if (profile.jitter <= 0.f)
+		return profile.latency;
+
+	float jitter = 0;
+	switch (profile.jitter_distribution)
+	{
+	case LinkProfile::JITTER_UNIFORM:
+		jitter = std::uniform_real_distribution<float>(0.f, profile.jitter)(random);
+		break;
+	case LinkProfile::JITTER_NORMAL:
+		jitter = Abs(std::normal_distribution<float>(0.f, profile.jitter)(random));
+		break;
+	case LinkProfile::JITTER_EXPONENTIAL:
+		jitter = std::exponential_distribution<float>(1.f / profile.jitter)(random);
+		break;
+	}
+	return profile.latency + jitter;
+}
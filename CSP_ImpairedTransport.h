@@ -0,0 +1,108 @@
+#pragma once
+
+#include "CSP_Transport.h"
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Core/Object.h>
+#include <random>
+
+using namespace Urho3D;
+
+
+/*
+Link conditions to simulate, one way.
+*/
+struct LinkProfile
+{
+	// Fixed one way delay in seconds
+	float latency = 0;
+
+	// Random extra delay in seconds, its scale per distribution
+	float jitter = 0;
+	enum JitterDistribution
+	{
+		// Between 0 and jitter
+		JITTER_UNIFORM,
+		// Absolute value of a normal distribution with jitter as standard deviation
+		JITTER_NORMAL,
+		// Exponential with jitter as mean, a long tail of late messages
+		JITTER_EXPONENTIAL
+	};
+	JitterDistribution jitter_distribution = JITTER_UNIFORM;
+
+	// Chance to lose a message while the link is good
+	float loss = 0;
+	// Gilbert-Elliott burst loss: chance per message for the link to turn bad and to recover, and the loss while bad
+	float burst_start = 0;
+	float burst_end = 0.5f;
+	float burst_loss = 1.f;
+
+	// Chance to send a message twice
+	float duplication = 0;
+	// Chance to hold a message back by reorder_delay seconds, so later ones overtake it
+	float reordering = 0;
+	float reorder_delay = 0.05f;
+};
+
+
+/*
+Transport wrapping another one with simulated latency, jitter, loss, duplication and reordering on the sent messages.
+
+Wrap both the server's and the clients' transports to impair both directions. Random draws come from a seeded
+generator and delays are counted in physics ticks, so a run with the same seed and inputs is reproducible.
+Reliable messages are only delayed, and stay in order.
+*/
+struct ImpairedTransport : CSP_Transport
+{
+	ImpairedTransport(CSP_Transport* transport, const LinkProfile& profile, unsigned seed = 1);
+
+	// Conditions of the messages sent from now on
+	LinkProfile profile;
+
+	// Messages sent, lost, duplicated and held back for reordering
+	unsigned messages_sent = 0;
+	unsigned messages_lost = 0;
+	unsigned messages_duplicated = 0;
+	unsigned messages_reordered = 0;
+
+	// Send the delayed messages due by the end of a tick
+	void update(float time_step) override;
+
+	bool is_server_running() const override { return transport->is_server_running(); }
+	void get_clients(PODVector<Object*>& result) const override { transport->get_clients(result); }
+	Object* get_server() const override { return transport->get_server(); }
+
+	void send(Object* peer, int message_id, bool reliable, const VectorBuffer& message) override;
+
+	bool is_client(Object* peer) const override { return transport->is_client(peer); }
+	Scene* get_scene(Object* peer) const override { return transport->get_scene(peer); }
+	bool is_scene_loaded(Object* peer) const override { return transport->is_scene_loaded(peer); }
+	Vector3 get_position(Object* peer) const override { return transport->get_position(peer); }
+	String get_name(Object* peer) const override { return transport->get_name(peer); }
+
+protected:
+	SharedPtr<CSP_Transport> transport;
+	std::mt19937 random;
+
+	// Seconds of ticks passed
+	float time = 0;
+	// Whether the burst loss is going on
+	bool burst = false;
+	// Due time of the last reliable message, to keep them in order
+	float last_reliable_due = 0;
+
+	struct DelayedMessage
+	{
+		float due;
+		WeakPtr<Object> peer;
+		int message_id;
+		bool reliable;
+		PODVector<unsigned char> data;
+	};
+	// Delayed messages in due order
+	Vector<DelayedMessage> delayed;
+
+	// Uniform random number in [0, 1)
+	float chance();
+	// Delay of a message in seconds
+	float sample_delay();
+};
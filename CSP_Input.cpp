@@ -0,0 +1,100 @@
+#include "CSP_Input.h"
+
+#include <Urho3D/IO/Deserializer.h>
+#include <Urho3D/IO/Serializer.h>
+
+// Changed fields mask bits
+static constexpr unsigned char CHANGED_BUTTONS = 1;
+static constexpr unsigned char CHANGED_YAW = 2;
+static constexpr unsigned char CHANGED_PITCH = 4;
+static constexpr unsigned char CHANGED_PAYLOAD = 8;
+
+void InputRecord::write(Serializer & dest) const
+{
+	dest.WriteUInt(id);
+	dest.WriteUInt(buttons);
+	dest.WriteFloat(yaw);
+	dest.WriteFloat(pitch);
+	dest.Write(payload, sizeof(payload));
+}
+
+void InputRecord::read(Deserializer & source)
+{
+	id = source.ReadUInt();
+	buttons = source.ReadUInt();
+	yaw = source.ReadFloat();
+	pitch = source.ReadFloat();
+	if (source.Read(payload, sizeof(payload)) != sizeof(payload))
+		std::memset(payload, 0, sizeof(payload));
+}
+
+void InputRecord::write_delta(Serializer & dest, const InputRecord & reference) const
+{
+	unsigned char changed = 0;
+	if (buttons != reference.buttons)
+		changed |= CHANGED_BUTTONS;
+	if (yaw != reference.yaw)
+		changed |= CHANGED_YAW;
+	if (pitch != reference.pitch)
+		changed |= CHANGED_PITCH;
+	if (std::memcmp(payload, reference.payload, sizeof(payload)) != 0)
+		changed |= CHANGED_PAYLOAD;
+
+	dest.WriteUByte(changed);
+	if (changed & CHANGED_BUTTONS)
+		dest.WriteUInt(buttons);
+	if (changed & CHANGED_YAW)
+		dest.WriteFloat(yaw);
+	if (changed & CHANGED_PITCH)
+		dest.WriteFloat(pitch);
+	if (changed & CHANGED_PAYLOAD)
+		dest.Write(payload, sizeof(payload));
+}
+
+void InputRecord::read_delta(Deserializer & source, const InputRecord & reference)
+{
+	const auto changed = source.ReadUByte();
+	buttons = changed & CHANGED_BUTTONS ? source.ReadUInt() : reference.buttons;
+	yaw = changed & CHANGED_YAW ? source.ReadFloat() : reference.yaw;
+	pitch = changed & CHANGED_PITCH ? source.ReadFloat() : reference.pitch;
+	if (!(changed & CHANGED_PAYLOAD))
+		std::memcpy(payload, reference.payload, sizeof(payload));
+	else if (source.Read(payload, sizeof(payload)) != sizeof(payload))
+		std::memset(payload, 0, sizeof(payload));
+}
+
+
+void InputBuffer::push(const InputRecord & input)
+{
+	if (count > 0 && input.id != first + count)
+		count = 0;
+	if (count == 0)
+		first = input.id;
+
+	// Drop the oldest input
+	if (count == SIZE)
+	{
+		++first;
+		--count;
+	}
+
+	records[input.id % SIZE] = input;
+	++count;
+}
+
+void InputBuffer::remove_until(ID id)
+{
+	// Handle range looping correctly
+	const auto removed = static_cast<int>(id - first) + 1;
+	if (removed <= 0)
+		return;
+
+	if (static_cast<unsigned>(removed) >= count)
+	{
+		count = 0;
+		return;
+	}
+
+	first += removed;
+	count -= removed;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstring>
+#include <type_traits>
+
+namespace Urho3D
+{
+	class Deserializer;
+	class Serializer;
+}
+
+using namespace Urho3D;
+
+
+// Size of the user defined input payload in bytes.
+// Override it with a compile definition to fit the game's input, it must be the same for the client and server builds.
+#ifndef CSP_INPUT_PAYLOAD_SIZE
+#define CSP_INPUT_PAYLOAD_SIZE 16
+#endif
+
+
+/*
+Fixed layout input record.
+Used instead of Controls, which needs a VariantMap for the input ID and any extra data.
+
+serialization structure:
+- input ID
+- buttons
+- yaw
+- pitch
+- payload
+*/
+struct InputRecord
+{
+	using ID = unsigned;
+
+	// Input sequence number, set by CSP_Client::add_input()
+	ID id = 0;
+	// Button state bits
+	unsigned buttons = 0;
+	// Mouse yaw/pitch
+	float yaw = 0;
+	float pitch = 0;
+	// User defined data, use get_payload() and set_payload()
+	alignas(8) unsigned char payload[CSP_INPUT_PAYLOAD_SIZE] = {};
+
+	// Set or clear buttons
+	void set(unsigned button_bits, bool down = true)
+	{
+		if (down)
+			buttons |= button_bits;
+		else
+			buttons &= ~button_bits;
+	}
+	// Check if any of the buttons are down
+	bool is_down(unsigned button_bits) const { return (buttons & button_bits) != 0; }
+
+	template<typename T>
+	T get_payload() const
+	{
+		check_payload_type<T>();
+		T value;
+		std::memcpy(&value, payload, sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	void set_payload(const T& value)
+	{
+		check_payload_type<T>();
+		std::memcpy(payload, &value, sizeof(T));
+	}
+
+	void write(Serializer& dest) const;
+	void read(Deserializer& source);
+
+	/*
+	Delta against a reference input, the ID isn't included.
+
+	serialization structure:
+	- changed fields mask
+	- changed fields
+	*/
+	void write_delta(Serializer& dest, const InputRecord& reference) const;
+	void read_delta(Deserializer& source, const InputRecord& reference);
+
+private:
+	template<typename T>
+	static void check_payload_type()
+	{
+		static_assert(sizeof(T) <= CSP_INPUT_PAYLOAD_SIZE, "Payload type is larger than CSP_INPUT_PAYLOAD_SIZE");
+		static_assert(std::is_trivially_copyable<T>::value, "Payload type must be trivially copyable");
+	}
+};
+
+
+/*
+Ring buffer of consecutive inputs indexed by input ID.
+Pushing and removing obsolete inputs are O(1) and never allocate.
+*/
+struct InputBuffer
+{
+	using ID = InputRecord::ID;
+
+	// Maximum number of buffered inputs, the oldest input is dropped when full
+	static constexpr unsigned SIZE = 128;
+
+	// Add the next input. An input that doesn't follow the newest one restarts the buffer.
+	void push(const InputRecord& input);
+	// Remove the inputs up to and including the ID
+	void remove_until(ID id);
+	void clear() { count = 0; }
+
+	unsigned size() const { return count; }
+	bool empty() const { return count == 0; }
+	// ID of the oldest input
+	ID first_id() const { return first; }
+	// Input by index from the oldest
+	InputRecord& operator[](unsigned index) { return records[(first + index) % SIZE]; }
+	const InputRecord& operator[](unsigned index) const { return records[(first + index) % SIZE]; }
+
+protected:
+	InputRecord records[SIZE];
+	ID first = 0;
+	unsigned count = 0;
+};
@@ -0,0 +1,138 @@
+#include "CSP_InterestGrid.h"
+
+#include <Urho3D/Scene/Node.h>
+
+void InterestGrid::add_node(Node * node, float radius)
+{
+	for (unsigned i = 0; i < added_nodes.Size(); ++i)
+	{
+		if (added_nodes[i] == node)
+		{
+			added_radii[i] = radius;
+			return;
+		}
+	}
+
+	added_nodes.Push(WeakPtr<Node>(node));
+	added_radii.Push(radius);
+}
+
+void InterestGrid::remove_node(Node * node)
+{
+	for (unsigned i = 0; i < added_nodes.Size(); ++i)
+	{
+		if (added_nodes[i] == node)
+		{
+			added_nodes.Erase(i);
+			added_radii.Erase(i);
+			return;
+		}
+	}
+}
+
+void InterestGrid::update()
+{
+	nodes.Clear();
+	positions.Clear();
+	radii.Clear();
+	node_cells.Clear();
+	max_radius = 0.f;
+
+	// Keep the cells' storage, forgetting the ones left empty since the last update
+	for (auto it = cells.Begin(); it != cells.End();)
+	{
+		if (it->second_.Empty())
+			it = cells.Erase(it);
+		else
+		{
+			it->second_.Clear();
+			++it;
+		}
+	}
+
+	for (unsigned i = 0; i < added_nodes.Size();)
+	{
+		// Forget removed nodes
+		auto node = added_nodes[i].Get();
+		if (!node)
+		{
+			added_nodes.Erase(i);
+			added_radii.Erase(i);
+			continue;
+		}
+
+		const auto position = node->GetWorldPosition();
+		const auto cell = get_cell(position);
+
+		cells[hash_cell(cell)].Push(nodes.Size());
+		nodes.Push(node);
+		positions.Push(position);
+		radii.Push(added_radii[i]);
+		node_cells.Push(cell);
+		max_radius = Max(max_radius, added_radii[i]);
+		++i;
+	}
+}
+
+void InterestGrid::query(const Vector3 & position, float radius, PODVector<Node*>& result) const
+{
+	auto is_relevant = [&](unsigned i) {
+		const auto distance = radius + radii[i];
+		return (positions[i] - position).LengthSquared() <= distance * distance;
+	};
+
+	// Big nodes can be relevant from further cells
+	const auto reach = radius + max_radius;
+	const auto min_cell = get_cell(position - Vector3::ONE * reach);
+	const auto max_cell = get_cell(position + Vector3::ONE * reach);
+	const auto cell_count =
+		static_cast<float>(max_cell.x_ - min_cell.x_ + 1) *
+		static_cast<float>(max_cell.y_ - min_cell.y_ + 1) *
+		static_cast<float>(max_cell.z_ - min_cell.z_ + 1);
+
+	// Checking every node is cheaper than visiting more cells than there are nodes
+	if (cell_count >= nodes.Size())
+	{
+		for (unsigned i = 0; i < nodes.Size(); ++i)
+		{
+			if (is_relevant(i))
+				result.Push(nodes[i]);
+		}
+		return;
+	}
+
+	IntVector3 cell;
+	for (cell.z_ = min_cell.z_; cell.z_ <= max_cell.z_; ++cell.z_)
+	{
+		for (cell.y_ = min_cell.y_; cell.y_ <= max_cell.y_; ++cell.y_)
+		{
+			for (cell.x_ = min_cell.x_; cell.x_ <= max_cell.x_; ++cell.x_)
+			{
+				auto it = cells.Find(hash_cell(cell));
+				if (it == cells.End())
+					continue;
+
+				for (auto i : it->second_)
+				{
+					if (node_cells[i] == cell && is_relevant(i))
+						result.Push(nodes[i]);
+				}
+			}
+		}
+	}
+}
+
+IntVector3 InterestGrid::get_cell(const Vector3 & position) const
+{
+	return IntVector3(
+		FloorToInt(position.x_ / cell_size),
+		FloorToInt(position.y_ / cell_size),
+		FloorToInt(position.z_ / cell_size));
+}
+
+unsigned InterestGrid::hash_cell(const IntVector3 & cell)
+{
+	return static_cast<unsigned>(cell.x_) * 73856093u ^
+		static_cast<unsigned>(cell.y_) * 19349663u ^
+		static_cast<unsigned>(cell.z_) * 83492791u;
+}
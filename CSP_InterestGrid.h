@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace Urho3D
+{
+	class Node;
+}
+
+using namespace Urho3D;
+
+
+/*
+Spatial hash grid of networked nodes, used to find the nodes relevant to an observer.
+
+The grid is rebuilt from the nodes' world positions by update(), once per snapshot,
+so a query only visits the cells around the observer and its cost follows the local node density.
+Cells are stored sparsely by the hash of their coordinates.
+*/
+struct InterestGrid
+{
+	// Cell edge length, about the interest radius works well
+	float cell_size = 25.f;
+
+	// Add a node, relevant from radius further away than the query radius, for big nodes
+	void add_node(Node* node, float radius = 0.f);
+	void remove_node(Node* node);
+
+	// Bin the nodes by their current world position
+	void update();
+	// Append the nodes within a radius of a position to result, as of the last update
+	void query(const Vector3& position, float radius, PODVector<Node*>& result) const;
+
+	// Nodes as of the last update
+	const PODVector<Node*>& get_nodes() const { return nodes; }
+	// Number of nodes as of the last update
+	unsigned size() const { return nodes.Size(); }
+
+protected:
+	// Added nodes and their extra radius
+	Vector<WeakPtr<Node>> added_nodes;
+	PODVector<float> added_radii;
+
+	// Node state as of the last update
+	PODVector<Node*> nodes;
+	PODVector<Vector3> positions;
+	PODVector<float> radii;
+	PODVector<IntVector3> node_cells;
+	float max_radius = 0.f;
+
+	// Node indices by cell hash. Colliding cells share a list, so entries are checked against their own cell.
+	HashMap<unsigned, PODVector<unsigned>> cells;
+
+	IntVector3 get_cell(const Vector3& position) const;
+	static unsigned hash_cell(const IntVector3& cell);
+};
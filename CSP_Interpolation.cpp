@@ -0,0 +1,126 @@
+#include "CSP_Interpolation.h"
+
+#include <Urho3D/Scene/Node.h>
+
+void InterpolationBuffer::add_node(Node * node)
+{
+	if (contains(node->GetID()))
+		return;
+
+	track_indices[node->GetID()] = tracks.Size();
+	tracks.Push(Track());
+	tracks.Back().node = node;
+	tracks.Back().node_id = node->GetID();
+}
+
+void InterpolationBuffer::remove_node(Node * node)
+{
+	auto i = track_indices.Find(node->GetID());
+	if (i == track_indices.End())
+		return;
+
+	// Move the last track into the removed track's place to keep the array dense
+	const auto index = i->second_;
+	track_indices.Erase(i);
+	if (index != tracks.Size() - 1)
+	{
+		tracks[index] = tracks.Back();
+		track_indices[tracks[index].node_id] = index;
+	}
+	tracks.Pop();
+}
+
+bool InterpolationBuffer::push(unsigned node_id, ID tick, const Vector3 & position, const Quaternion & rotation, const Vector3 & velocity)
+{
+	auto i = track_indices.Find(node_id);
+	if (i == track_indices.End())
+		return false;
+
+	auto& track = tracks[i->second_];
+
+	// States arrive unordered, older ones are of no use anymore. Handle range looping correctly
+	if (track.count > 0 && int(tick - track.get(track.count - 1).tick) <= 0)
+		return true;
+
+	// Drop the oldest state
+	if (track.count == SIZE)
+	{
+		track.first = (track.first + 1) % SIZE;
+		--track.count;
+	}
+
+	track.samples[(track.first + track.count) % SIZE] = { tick, position, rotation, velocity };
+	++track.count;
+	return true;
+}
+
+void InterpolationBuffer::update(ID render_tick, float fraction, float timestep)
+{
+	for (unsigned i = 0; i < tracks.Size();)
+	{
+		auto& track = tracks[i];
+		auto node = track.node.Get();
+		if (!node)
+		{
+			// Forget removed nodes, moving the last track into this one's place
+			track_indices.Erase(track.node_id);
+			if (i != tracks.Size() - 1)
+			{
+				tracks[i] = tracks.Back();
+				track_indices[tracks[i].node_id] = i;
+			}
+			tracks.Pop();
+			continue;
+		}
+		++i;
+
+		if (track.count == 0)
+			continue;
+
+		// Ticks from a state to the render tick. Handle range looping correctly
+		auto ticks_since = [&](const Sample& sample) { return static_cast<float>(int(render_tick - sample.tick)) + fraction; };
+
+		// Forget the states before the one preceding the render tick
+		while (track.count > 1 && ticks_since(track.get(1)) >= 0.f)
+		{
+			track.first = (track.first + 1) % SIZE;
+			--track.count;
+		}
+
+		const auto& from = track.get(0);
+
+		if (ticks_since(from) < 0.f)
+		{
+			// Not buffered long enough yet
+			++underruns;
+			node->SetWorldPosition(from.position);
+			node->SetWorldRotation(from.rotation);
+		}
+		else if (track.count > 1)
+		{
+			const auto& to = track.get(1);
+			const auto t = ticks_since(from) / static_cast<float>(int(to.tick - from.tick));
+			node->SetWorldPosition(from.position.Lerp(to.position, t));
+			node->SetWorldRotation(from.rotation.Slerp(to.rotation, t));
+		}
+		else
+		{
+			// The newer state is missing, keep going along the last velocity for a while
+			++extrapolations;
+			const auto elapsed = Min(ticks_since(from) * timestep, max_extrapolation);
+			node->SetWorldPosition(from.position + from.velocity * elapsed);
+			node->SetWorldRotation(from.rotation);
+		}
+	}
+}
+
+void InterpolationBuffer::clear()
+{
+	for (auto& track : tracks)
+	{
+		track.first = 0;
+		track.count = 0;
+	}
+	extrapolations = 0;
+	underruns = 0;
+}
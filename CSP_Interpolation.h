@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Quaternion.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace Urho3D
+{
+	class Node;
+}
+
+using namespace Urho3D;
+
+
+/*
+Snapshot buffer of remote nodes on the client, shown a fixed delay in the past.
+
+Received states of the added nodes are buffered by server tick instead of being applied,
+and each frame the nodes are placed between the two states around the render tick.
+Ticks are whole numbers with the render tick's fraction apart, so long running servers don't lose precision.
+When the newer state is missing the node is extrapolated along its last velocity, for a limited time.
+
+The nodes are moved directly, so their rigid bodies should be kinematic on the client.
+Kinematic bodies aren't part of the physics history, so rewinding and replaying leaves them alone.
+*/
+struct InterpolationBuffer
+{
+	using ID = unsigned;
+
+	// States buffered per node
+	static constexpr unsigned SIZE = 16;
+
+	// How far in the past the nodes are shown in seconds, about two snapshot intervals plus jitter
+	float delay = 0.1f;
+	// Longest time to extrapolate past the newest state in seconds, the node stops there afterwards
+	float max_extrapolation = 0.25f;
+
+	// Add a remote node to interpolate
+	void add_node(Node* node);
+	void remove_node(Node* node);
+	bool contains(unsigned node_id) const { return track_indices.Contains(node_id); }
+	bool empty() const { return tracks.Empty(); }
+
+	// Buffer a node's state at a server tick. Returns false if the node isn't interpolated.
+	bool push(unsigned node_id, ID tick, const Vector3& position, const Quaternion& rotation, const Vector3& velocity);
+	// Place the nodes at a server tick and fraction of a tick, usually the estimated server time minus the delay.
+	// Forgets the nodes which were removed.
+	void update(ID render_tick, float fraction, float timestep);
+	// Forget the buffered states
+	void clear();
+
+	// Frames a node was extrapolated, or held at its oldest state because the buffer was too short
+	unsigned extrapolations = 0;
+	unsigned underruns = 0;
+
+protected:
+	struct Sample
+	{
+		ID tick;
+		Vector3 position;
+		Quaternion rotation;
+		Vector3 velocity;
+	};
+
+	struct Track
+	{
+		WeakPtr<Node> node;
+		// Kept to forget the track once the node is gone
+		unsigned node_id = 0;
+		// Ring buffer in ascending tick order
+		Sample samples[SIZE];
+		unsigned first = 0;
+		unsigned count = 0;
+
+		const Sample& get(unsigned i) const { return samples[(first + i) % SIZE]; }
+	};
+
+	Vector<Track> tracks;
+	// Track index by node ID
+	HashMap<unsigned, unsigned> track_indices;
+};
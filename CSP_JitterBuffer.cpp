@@ -0,0 +1,96 @@
+#include "CSP_JitterBuffer.h"
+
+#include <Urho3D/Math/MathDefs.h>
+#include <cmath>
+
+// Jitter estimate smoothing, as in RFC 3550
+static constexpr float JITTER_SMOOTHING = 1.f / 16.f;
+
+void JitterBuffer::push(const InputRecord & input)
+{
+	// Drop the oldest input
+	if (count == SIZE)
+	{
+		first = (first + 1) % SIZE;
+		--count;
+		++overflows;
+	}
+
+	records[(first + count) % SIZE] = input;
+	++count;
+}
+
+void JitterBuffer::on_message(ID newest_id, float time, float timestep)
+{
+	// Reordered messages don't tell anything new. Handle range looping correctly
+	if (has_arrival && static_cast<int>(newest_id - last_arrival_id) <= 0)
+		return;
+
+	if (has_arrival && timestep > 0.f)
+	{
+		// Difference between the arrival interval and the interval the inputs were sampled at
+		const auto expected = static_cast<int>(newest_id - last_arrival_id) * timestep;
+		const auto deviation = Abs((time - last_arrival_time) - expected);
+		jitter += (deviation - jitter) * JITTER_SMOOTHING;
+
+		// Enough inputs to cover twice the average deviation
+		const auto depth = static_cast<unsigned>(std::ceil(jitter * 2.f / timestep)) + 1;
+		target_depth = Clamp(depth, min_depth, Min(max_depth, static_cast<unsigned>(SIZE)));
+	}
+
+	last_arrival_id = newest_id;
+	last_arrival_time = time;
+	has_arrival = true;
+}
+
+bool JitterBuffer::pop(InputRecord & input)
+{
+	if (count == 0)
+	{
+		if (!has_last)
+			return false;
+
+		refilling = true;
+		++starvations;
+		input = last;
+		return true;
+	}
+
+	// Rebuild the depth the jitter needs before resuming
+	if (refilling && count < target_depth)
+	{
+		++starvations;
+		input = last;
+		return true;
+	}
+	refilling = false;
+
+	// Catch up one input per tick while well above the target depth
+	if (count > target_depth * 2 + 1)
+	{
+		first = (first + 1) % SIZE;
+		--count;
+		++overflows;
+	}
+
+	last = records[first];
+	has_last = true;
+	first = (first + 1) % SIZE;
+	--count;
+
+	input = last;
+	return true;
+}
+
+void JitterBuffer::clear()
+{
+	first = 0;
+	count = 0;
+	has_last = false;
+	refilling = false;
+	has_arrival = false;
+	jitter = 0;
+	target_depth = min_depth;
+	starvations = 0;
+	overflows = 0;
+}
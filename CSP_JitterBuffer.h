@@ -0,0 +1,61 @@
+#pragma once
+
+#include "CSP_Input.h"
+
+
+/*
+Fixed capacity buffer of a client's inputs on the server.
+
+The target depth follows the measured arrival jitter of the client's input messages.
+When the buffer starves the last input is repeated until the buffer is back to the target depth,
+so the next jitter spike is absorbed instead of starving again. When it grows well above the target depth
+extra inputs are skipped to catch up, so latency doesn't build up.
+*/
+struct JitterBuffer
+{
+	using ID = InputRecord::ID;
+
+	// Maximum number of buffered inputs, the oldest input is dropped when full
+	static constexpr unsigned SIZE = 64;
+
+	// Target depth limits in inputs
+	unsigned min_depth = 1;
+	unsigned max_depth = 16;
+
+	// Add an input newer than the buffered ones
+	void push(const InputRecord& input);
+	// Update the jitter estimate with the newest input ID of a received message and its arrival time in seconds
+	void on_message(ID newest_id, float time, float timestep);
+	// Take the input for the current tick. Returns false if no input was ever received.
+	bool pop(InputRecord& input);
+	void clear();
+
+	unsigned size() const { return count; }
+	bool empty() const { return count == 0; }
+	unsigned get_target_depth() const { return target_depth; }
+	// Smoothed arrival jitter in seconds
+	float get_jitter() const { return jitter; }
+
+	// Ticks the last input was repeated because no new input was buffered, or while refilling after that
+	unsigned starvations = 0;
+	// Inputs dropped because the buffer was full or skipped to catch up
+	unsigned overflows = 0;
+
+protected:
+	InputRecord records[SIZE];
+	unsigned first = 0;
+	unsigned count = 0;
+
+	// Last popped input, repeated when starving
+	InputRecord last;
+	bool has_last = false;
+	// Starved, holding the inputs back until the buffer is at the target depth again
+	bool refilling = false;
+
+	unsigned target_depth = 1;
+	float jitter = 0;
+	// Previous message arrival
+	ID last_arrival_id = 0;
+	float last_arrival_time = 0;
+	bool has_arrival = false;
+};
@@ -0,0 +1,364 @@
+#include "CSP_LagCompensation.h"
+
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/Math/Ray.h>
+#include <Urho3D/Math/Sphere.h>
+#include <Urho3D/Physics/PhysicsUtils.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Node.h>
+#include <Bullet/BulletCollision/CollisionDispatch/btCollisionWorld.h>
+#include <Bullet/BulletCollision/CollisionShapes/btSphereShape.h>
+#include <Bullet/BulletDynamics/Dynamics/btRigidBody.h>
+
+// Reports whether two collision objects touch
+struct OverlapCallback : btCollisionWorld::ContactResultCallback
+{
+	bool overlap = false;
+
+	btScalar addSingleResult(btManifoldPoint& point, const btCollisionObjectWrapper*, int, int, const btCollisionObjectWrapper*, int, int) override
+	{
+		if (point.getDistance() <= 0.f)
+			overlap = true;
+		return 0.f;
+	}
+};
+
+void LagCompensation::set_capacity(unsigned ticks, unsigned nodes_per_tick)
+{
+	tick_capacity = ticks;
+	node_capacity = nodes_per_tick;
+
+	tick_ids.Resize(ticks);
+	tick_saved.Resize(ticks);
+	node_counts.Resize(ticks);
+
+	const auto size = ticks * nodes_per_tick;
+	node_ids.Resize(size);
+	positions.Resize(size);
+	rotations.Resize(size);
+	bounds.Resize(size);
+	body_positions.Resize(size);
+	body_rotations.Resize(size);
+
+	clear();
+}
+
+void LagCompensation::add_node(Node * node)
+{
+	const auto id = node->GetID();
+
+	unsigned i = 0;
+	for (; i < nodes.Size(); ++i)
+	{
+		if (nodes[i] == node)
+			return;
+		if (nodes[i] && nodes[i]->GetID() > id)
+			break;
+	}
+
+	nodes.Insert(i, WeakPtr<Node>(node));
+	nodes_by_id[id] = node;
+}
+
+void LagCompensation::remove_node(Node * node)
+{
+	nodes.Remove(WeakPtr<Node>(node));
+	nodes_by_id.Erase(node->GetID());
+}
+
+void LagCompensation::save(ID tick)
+{
+	if (tick_capacity == 0)
+		return;
+
+	const auto slot = tick % tick_capacity;
+	const auto first = slot * node_capacity;
+
+	unsigned count = 0;
+	bool removed = false;
+	for (unsigned i = 0; i < nodes.Size();)
+	{
+		// Forget removed nodes
+		auto node = nodes[i].Get();
+		if (!node)
+		{
+			nodes.Erase(i);
+			removed = true;
+			continue;
+		}
+		++i;
+
+		if (count == node_capacity)
+		{
+			if (!warned_capacity)
+			{
+				URHO3D_LOGWARNING("LagCompensation node capacity exceeded, the rest of the nodes aren't saved");
+				warned_capacity = true;
+			}
+			break;
+		}
+
+		const auto index = first + count++;
+		node_ids[index] = node->GetID();
+		positions[index] = node->GetWorldPosition();
+		rotations[index] = node->GetWorldRotation();
+
+		// Bodies' broadphase bounds and transform, a point for nodes without a body
+		auto rigid_body = node->GetComponent<RigidBody>();
+		if (rigid_body && rigid_body->GetBody())
+		{
+			auto body = rigid_body->GetBody();
+			btVector3 aabb_min, aabb_max;
+			body->getAabb(aabb_min, aabb_max);
+			bounds[index] = BoundingBox(ToVector3(aabb_min), ToVector3(aabb_max));
+			body_positions[index] = ToVector3(body->getWorldTransform().getOrigin());
+			body_rotations[index] = ToQuaternion(body->getWorldTransform().getRotation());
+		}
+		else
+		{
+			bounds[index] = BoundingBox(positions[index], positions[index]);
+			body_positions[index] = positions[index];
+			body_rotations[index] = rotations[index];
+		}
+	}
+
+	if (removed)
+	{
+		for (auto it = nodes_by_id.Begin(); it != nodes_by_id.End();)
+		{
+			if (!it->second_)
+				it = nodes_by_id.Erase(it);
+			else
+				++it;
+		}
+	}
+
+	tick_ids[slot] = tick;
+	tick_saved[slot] = true;
+	node_counts[slot] = count;
+}
+
+void LagCompensation::clear()
+{
+	for (unsigned i = 0; i < tick_saved.Size(); ++i)
+		tick_saved[i] = false;
+	warned_capacity = false;
+}
+
+bool LagCompensation::has_tick(ID tick, float fraction) const
+{
+	return find_tick(tick) >= 0 &&
+		(fraction <= 0.f || find_tick(tick + 1) >= 0);
+}
+
+template<typename F>
+bool LagCompensation::for_each_node(ID tick, float fraction, F function) const
+{
+	const auto earlier = tick;
+	const auto earlier_slot = find_tick(earlier);
+	if (earlier_slot < 0)
+		return false;
+
+	// Past the newest tick, use the earlier one as is
+	auto t = Clamp(fraction, 0.f, 1.f);
+	const auto later_slot = t > 0.f ? find_tick(earlier + 1) : -1;
+	if (later_slot < 0)
+		t = 0.f;
+
+	const auto earlier_first = static_cast<unsigned>(earlier_slot) * node_capacity;
+	const auto earlier_end = earlier_first + node_counts[earlier_slot];
+	auto later = later_slot >= 0 ? static_cast<unsigned>(later_slot) * node_capacity : 0;
+	const auto later_end = later_slot >= 0 ? later + node_counts[later_slot] : 0;
+
+	// Merge the two ticks' nodes by ID
+	for (auto i = earlier_first; i < earlier_end; ++i)
+	{
+		while (later < later_end && node_ids[later] < node_ids[i])
+			++later;
+
+		const auto match = later < later_end && node_ids[later] == node_ids[i];
+		function(i, match ? static_cast<int>(later) : -1, t);
+	}
+
+	return true;
+}
+
+bool LagCompensation::get_transform(unsigned node_id, ID tick, float fraction, Vector3 & position, Quaternion & rotation) const
+{
+	const auto earlier = tick;
+	const auto earlier_slot = find_tick(earlier);
+	if (earlier_slot < 0)
+		return false;
+	const auto earlier_index = find_node(earlier_slot, node_id);
+	if (earlier_index < 0)
+		return false;
+
+	position = positions[earlier_index];
+	rotation = rotations[earlier_index];
+
+	const auto t = Clamp(fraction, 0.f, 1.f);
+	const auto later_slot = t > 0.f ? find_tick(earlier + 1) : -1;
+	const auto later_index = later_slot >= 0 ? find_node(later_slot, node_id) : -1;
+	if (later_index >= 0)
+	{
+		position = position.Lerp(positions[later_index], t);
+		rotation = rotation.Slerp(rotations[later_index], t);
+	}
+
+	return true;
+}
+
+bool LagCompensation::raycast(const Ray & ray, ID tick, float fraction, float max_distance, Hit & hit, unsigned ignore_node_id) const
+{
+	auto closest = max_distance;
+	bool found = false;
+
+	const btTransform ray_from(btQuaternion::getIdentity(), ToBtVector3(ray.origin_));
+	const btTransform ray_to(btQuaternion::getIdentity(), ToBtVector3(ray.origin_ + ray.direction_ * max_distance));
+	btCollisionObject object;
+
+	const auto in_history = for_each_node(tick, fraction, [&](unsigned earlier, int later, float t) {
+		if (node_ids[earlier] == ignore_node_id)
+			return;
+
+		BoundingBox box;
+		Vector3 body_position;
+		Quaternion body_rotation;
+		interpolate(earlier, later, t, box, body_position, body_rotation);
+
+		auto rigid_body = get_body(node_ids[earlier]);
+		if (!rigid_body)
+		{
+			const auto distance = ray.HitDistance(box);
+			if (distance < M_INFINITY && distance <= closest)
+			{
+				closest = distance;
+				hit.node_id = node_ids[earlier];
+				hit.distance = distance;
+				found = true;
+			}
+			return;
+		}
+
+		// Bounds of both ticks, so a body rotating in between isn't rejected
+		auto check_box = bounds[earlier];
+		if (later >= 0)
+			check_box.Merge(bounds[later]);
+		const auto box_distance = ray.HitDistance(check_box);
+		if (box_distance == M_INFINITY || box_distance > closest)
+			return;
+
+		auto shape = rigid_body->GetBody()->getCollisionShape();
+		object.setCollisionShape(shape);
+		const btTransform transform(ToBtQuaternion(body_rotation), ToBtVector3(body_position));
+		btCollisionWorld::ClosestRayResultCallback callback(ray_from.getOrigin(), ray_to.getOrigin());
+		btCollisionWorld::rayTestSingle(ray_from, ray_to, &object, shape, transform, callback);
+		if (!callback.hasHit())
+			return;
+
+		const auto distance = callback.m_closestHitFraction * max_distance;
+		if (distance <= closest)
+		{
+			closest = distance;
+			hit.node_id = node_ids[earlier];
+			hit.distance = distance;
+			found = true;
+		}
+	});
+
+	return in_history && found;
+}
+
+bool LagCompensation::overlap(const Sphere & sphere, ID tick, float fraction, PODVector<unsigned>& result) const
+{
+	btSphereShape sphere_shape(sphere.radius_);
+	btCollisionObject sphere_object;
+	sphere_object.setCollisionShape(&sphere_shape);
+	sphere_object.setWorldTransform(btTransform(btQuaternion::getIdentity(), ToBtVector3(sphere.center_)));
+	btCollisionObject object;
+
+	return for_each_node(tick, fraction, [&](unsigned earlier, int later, float t) {
+		BoundingBox box;
+		Vector3 body_position;
+		Quaternion body_rotation;
+		interpolate(earlier, later, t, box, body_position, body_rotation);
+
+		auto rigid_body = get_body(node_ids[earlier]);
+		if (!rigid_body)
+		{
+			if (sphere.IsInside(box) != OUTSIDE)
+				result.Push(node_ids[earlier]);
+			return;
+		}
+
+		auto check_box = bounds[earlier];
+		if (later >= 0)
+			check_box.Merge(bounds[later]);
+		if (sphere.IsInside(check_box) == OUTSIDE)
+			return;
+
+		object.setCollisionShape(rigid_body->GetBody()->getCollisionShape());
+		object.setWorldTransform(btTransform(ToBtQuaternion(body_rotation), ToBtVector3(body_position)));
+		OverlapCallback callback;
+		rigid_body->GetPhysicsWorld()->GetWorld()->contactPairTest(&sphere_object, &object, callback);
+		if (callback.overlap)
+			result.Push(node_ids[earlier]);
+	});
+}
+
+void LagCompensation::interpolate(unsigned earlier, int later, float t, BoundingBox & box, Vector3 & body_position, Quaternion & body_rotation) const
+{
+	box = bounds[earlier];
+	body_position = body_positions[earlier];
+	body_rotation = body_rotations[earlier];
+	if (later < 0)
+		return;
+
+	box = BoundingBox(box.min_.Lerp(bounds[later].min_, t), box.max_.Lerp(bounds[later].max_, t));
+	body_position = body_position.Lerp(body_positions[later], t);
+	body_rotation = body_rotation.Slerp(body_rotations[later], t);
+}
+
+RigidBody * LagCompensation::get_body(unsigned node_id) const
+{
+	auto it = nodes_by_id.Find(node_id);
+	if (it == nodes_by_id.End() || !it->second_)
+		return nullptr;
+
+	auto rigid_body = it->second_->GetComponent<RigidBody>();
+	if (!rigid_body || !rigid_body->GetBody() || !rigid_body->GetBody()->getCollisionShape() || !rigid_body->GetPhysicsWorld())
+		return nullptr;
+	return rigid_body;
+}
+
+int LagCompensation::find_tick(ID tick) const
+{
+	if (tick_capacity == 0)
+		return -1;
+
+	const auto slot = tick % tick_capacity;
+	if (!tick_saved[slot] || tick_ids[slot] != tick)
+		return -1;
+
+	return static_cast<int>(slot);
+}
+
+int LagCompensation::find_node(unsigned slot, unsigned node_id) const
+{
+	// Binary search, the nodes are in ascending ID order
+	auto low = slot * node_capacity;
+	auto high = low + node_counts[slot];
+	while (low < high)
+	{
+		const auto middle = low + (high - low) / 2;
+		if (node_ids[middle] < node_id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (low < slot * node_capacity + node_counts[slot] && node_ids[low] == node_id)
+		return static_cast<int>(low);
+	return -1;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/BoundingBox.h>
+#include <Urho3D/Math/Quaternion.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace Urho3D
+{
+	class Node;
+	class RigidBody;
+	class Ray;
+	class Sphere;
+}
+
+using namespace Urho3D;
+
+
+/*
+Ring buffer of the networked nodes' transforms and bounds on the server, one entry per tick.
+
+Used to validate a client's hits against the world as the client saw it when it sampled the input,
+without rewinding the live physics world. Queries interpolate between ticks, reject nodes by their world bounding boxes,
+and test the rest against their rigid body's collision shape at the interpolated body transform.
+Nodes without a body, or removed since, are tested against their bounds only.
+Game specific hitboxes can use the interpolated transforms.
+
+The state is stored per node in contiguous arrays, all allocated up front by set_capacity().
+Each tick's nodes are in ascending ID order, so lookups and interpolation between ticks are a binary search or a merge.
+*/
+struct LagCompensation
+{
+	using ID = unsigned;
+
+	// Allocate memory for a number of ticks and the maximum number of nodes per tick. No history is kept until then.
+	void set_capacity(unsigned ticks, unsigned nodes_per_tick);
+	unsigned get_tick_capacity() const { return tick_capacity; }
+
+	// Add a node to the history
+	void add_node(Node* node);
+	void remove_node(Node* node);
+
+	// Save the nodes' state under a tick ID, overwriting the tick that was tick_capacity IDs before it
+	void save(ID tick);
+	// Forget all the saved ticks
+	void clear();
+
+	// Queries take a tick and a fraction of the way to the next tick, kept apart so long running servers don't lose whole ticks
+
+	// Whether a tick, or both ticks around a fractional tick, can be queried
+	bool has_tick(ID tick, float fraction = 0.f) const;
+
+	// Transform of a node at a fractional tick. Returns false if the node or the tick isn't in the history.
+	bool get_transform(unsigned node_id, ID tick, float fraction, Vector3& position, Quaternion& rotation) const;
+
+	struct Hit
+	{
+		unsigned node_id = 0;
+		float distance = 0;
+	};
+	// Closest node whose collision shape a ray hits at a fractional tick, ignoring a node such as the shooter's.
+	// Returns false if nothing is hit within max_distance or the tick isn't in the history.
+	bool raycast(const Ray& ray, ID tick, float fraction, float max_distance, Hit& hit, unsigned ignore_node_id = 0) const;
+	// Append the IDs of the nodes whose collision shape overlaps a sphere at a fractional tick.
+	// Returns false if the tick isn't in the history.
+	bool overlap(const Sphere& sphere, ID tick, float fraction, PODVector<unsigned>& result) const;
+
+protected:
+	// Nodes in ascending ID order
+	Vector<WeakPtr<Node>> nodes;
+	// Same nodes by ID, to find the collision shapes of the nodes a query reaches
+	HashMap<unsigned, WeakPtr<Node>> nodes_by_id;
+
+	unsigned tick_capacity = 0;
+	unsigned node_capacity = 0;
+	bool warned_capacity = false;
+
+	// Per tick
+	PODVector<ID> tick_ids;
+	PODVector<bool> tick_saved;
+	PODVector<unsigned> node_counts;
+
+	// Per node per tick, slot * node_capacity + index
+	PODVector<unsigned> node_ids;
+	PODVector<Vector3> positions;
+	PODVector<Quaternion> rotations;
+	PODVector<BoundingBox> bounds;
+	// Rigid body's transform, which is offset from the node's by the center of mass
+	PODVector<Vector3> body_positions;
+	PODVector<Quaternion> body_rotations;
+
+	// Slot of a saved tick, -1 if it isn't in the history
+	int find_tick(ID tick) const;
+	// Index of a node in a slot, -1 if it wasn't saved
+	int find_node(unsigned slot, unsigned node_id) const;
+
+	// Interpolated bounds and body transform of a node's entry, the later index may be -1
+	void interpolate(unsigned earlier, int later, float t, BoundingBox& box, Vector3& body_position, Quaternion& body_rotation) const;
+	// Rigid body of a node still in the world, with a collision shape
+	RigidBody* get_body(unsigned node_id) const;
+
+	// Call a function with each node's index in the earlier slot, index in the later slot (or -1), and interpolation factor
+	template<typename F>
+	bool for_each_node(ID tick, float fraction, F function) const;
+};
@@ -0,0 +1,71 @@
+#include "CSP_LoopbackTransport.h"
+
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Scene/Scene.h>
+
+LoopbackPeer* LoopbackTransport::connect(LoopbackTransport & server_transport, Scene * server_scene, LoopbackTransport & client_transport, Scene * client_scene)
+{
+	SharedPtr<LoopbackPeer> client_peer(new LoopbackPeer(server_transport.context));
+	SharedPtr<LoopbackPeer> server_peer(new LoopbackPeer(client_transport.context));
+
+	client_peer->scene = server_scene;
+	client_peer->client = true;
+	client_peer->remote = server_peer;
+	client_peer->name = "loopback client " + String(server_transport.peers.Size());
+	server_peer->scene = client_scene;
+	server_peer->remote = client_peer;
+	server_peer->name = "loopback server";
+
+	server_transport.peers.Push(client_peer);
+	client_transport.peers.Clear();
+	client_transport.peers.Push(server_peer);
+	return client_peer;
+}
+
+void LoopbackTransport::set_position(const Vector3 & position)
+{
+	if (!server && !peers.Empty() && peers.Front()->remote)
+		peers.Front()->remote->position = position;
+}
+
+void LoopbackTransport::deliver(const std::function<void(Object* peer, int message_id, MemoryBuffer& message)>& handler)
+{
+	for (auto& peer : peers)
+	{
+		// The handler may send, which goes to the other side's inboxes
+		delivering.Clear();
+		delivering.Swap(peer->inbox);
+
+		for (auto& message : delivering)
+		{
+			MemoryBuffer buffer(message.data);
+			handler(peer, message.message_id, buffer);
+		}
+	}
+}
+
+void LoopbackTransport::get_clients(PODVector<Object*>& result) const
+{
+	result.Clear();
+	if (!server)
+		return;
+
+	for (auto& peer : peers)
+		result.Push(peer);
+}
+
+void LoopbackTransport::send(Object * peer, int message_id, bool reliable, const VectorBuffer & message)
+{
+	auto remote = static_cast<LoopbackPeer*>(peer)->remote;
+	if (!remote)
+		return;
+
+	++messages_sent;
+	bytes_sent += message.GetSize();
+
+	remote->inbox.Push(LoopbackPeer::Message());
+	auto& sent = remote->inbox.Back();
+	sent.message_id = message_id;
+	sent.data = message.GetBuffer();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "CSP_Transport.h"
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Core/Object.h>
+#include <functional>
+
+namespace Urho3D
+{
+	class MemoryBuffer;
+}
+
+using namespace Urho3D;
+
+
+/*
+Peer of a loopback transport: a client on the server's side, or the server on a client's side.
+Holds the messages the other side sent until they are delivered.
+*/
+struct LoopbackPeer : Object
+{
+	URHO3D_OBJECT(LoopbackPeer, Object);
+
+	LoopbackPeer(Context* context) : Object(context) {}
+
+	struct Message
+	{
+		int message_id;
+		PODVector<unsigned char> data;
+	};
+
+	// Scene replicated on this side
+	WeakPtr<Scene> scene;
+	// Observer position of the client
+	Vector3 position;
+	// Name of the peer, numbering the clients in connection order
+	String name;
+	bool client = false;
+	// The peer standing for this side on the other side
+	WeakPtr<LoopbackPeer> remote;
+	// Messages received from the other side, oldest first
+	Vector<Message> inbox;
+};
+
+
+/*
+In-memory transport connecting a server and clients in the same process, for headless benchmarks.
+
+Create a transport for the server and one per client, connect them, and deliver the received messages
+to CSP_Server::receive_message() and CSP_Client::receive_message() after each tick.
+Nothing is lost or reordered, messages arrive when delivered.
+*/
+struct LoopbackTransport : CSP_Transport
+{
+	LoopbackTransport(Context* context, bool server) : context(context), server(server) {}
+
+	// Connect a client's transport to the server's, each side replicating its own scene. Returns the client's peer on the server.
+	static LoopbackPeer* connect(LoopbackTransport& server_transport, Scene* server_scene, LoopbackTransport& client_transport, Scene* client_scene);
+
+	// Client side: set the observer position the server sees, like Connection::SetPosition()
+	void set_position(const Vector3& position);
+
+	// Hand the received messages to a handler, oldest first. Messages sent by the handler wait for the next delivery.
+	void deliver(const std::function<void(Object* peer, int message_id, MemoryBuffer& message)>& handler);
+
+	// Messages and bytes sent through this transport
+	unsigned messages_sent = 0;
+	unsigned long long bytes_sent = 0;
+
+	bool is_server_running() const override { return server; }
+	void get_clients(PODVector<Object*>& result) const override;
+	Object* get_server() const override { return !server && !peers.Empty() ? peers.Front().Get() : nullptr; }
+
+	void send(Object* peer, int message_id, bool reliable, const VectorBuffer& message) override;
+
+	bool is_client(Object* peer) const override { return static_cast<LoopbackPeer*>(peer)->client; }
+	Scene* get_scene(Object* peer) const override { return static_cast<LoopbackPeer*>(peer)->scene; }
+	bool is_scene_loaded(Object* peer) const override { return get_scene(peer) != nullptr; }
+	Vector3 get_position(Object* peer) const override { return static_cast<LoopbackPeer*>(peer)->position; }
+	String get_name(Object* peer) const override { return static_cast<LoopbackPeer*>(peer)->name; }
+
+protected:
+	Context* context;
+	bool server;
+	// Clients on the server, the server on a client
+	Vector<SharedPtr<LoopbackPeer>> peers;
+	// Reusable buffer of the messages being delivered
+	Vector<LoopbackPeer::Message> delivering;
+};
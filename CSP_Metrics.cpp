@@ -0,0 +1,183 @@
+#include "CSP_Metrics.h"
+
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/Math/MathDefs.h>
+#include <cstdio>
+
+void MetricCounter::write_json(String & result) const
+{
+	result.AppendWithFormat("{\"name\":\"%s\",\"connection\":\"%s\",\"type\":\"counter\",\"value\":%llu}",
+		name.CString(), connection.CString(), get());
+}
+
+String MetricCounter::get_summary() const
+{
+	return String(get());
+}
+
+void MetricGauge::write_json(String & result) const
+{
+	result.AppendWithFormat("{\"name\":\"%s\",\"connection\":\"%s\",\"type\":\"gauge\",\"value\":%g}",
+		name.CString(), connection.CString(), get());
+}
+
+String MetricGauge::get_summary() const
+{
+	return String(get());
+}
+
+MetricHistogram::MetricHistogram(const String & name, const String & connection, std::initializer_list<float> bounds) :
+	Metric(HISTOGRAM, name, connection)
+{
+	for (auto bound : bounds)
+	{
+		if (num_bounds == MAX_BUCKETS)
+			break;
+		this->bounds[num_bounds++] = bound;
+	}
+
+	for (auto& bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+void MetricHistogram::record(float value)
+{
+	// Few buckets, a linear search is as fast as a binary one
+	unsigned index = 0;
+	while (index < num_bounds && value > bounds[index])
+		++index;
+
+	buckets[index].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+
+	auto current = sum.load(std::memory_order_relaxed);
+	while (!sum.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+		;
+}
+
+void MetricHistogram::write_json(String & result) const
+{
+	result.AppendWithFormat("{\"name\":\"%s\",\"connection\":\"%s\",\"type\":\"histogram\",\"count\":%llu,\"sum\":%g,\"buckets\":[",
+		name.CString(), connection.CString(), get_count(), get_sum());
+
+	for (unsigned i = 0; i < num_bounds; ++i)
+		result.AppendWithFormat("[%g,%llu],", bounds[i], get_bucket(i));
+	result.AppendWithFormat("[\"inf\",%llu]]}", get_bucket(num_bounds));
+}
+
+String MetricHistogram::get_summary() const
+{
+	const auto samples = get_count();
+	return ToString("mean %g of %llu", samples ? get_sum() / samples : 0.0, samples);
+}
+
+MetricCounter* MetricsRegistry::counter(const String & name, const String & connection)
+{
+	if (auto metric = find(name, connection))
+	{
+		if (metric->type == Metric::COUNTER)
+			return static_cast<MetricCounter*>(metric);
+		return counter(get_clash_name(*metric, "counter"), connection);
+	}
+
+	auto metric = new MetricCounter(name, connection);
+	metrics.Push(SharedPtr<Metric>(metric));
+	return metric;
+}
+
+MetricGauge* MetricsRegistry::gauge(const String & name, const String & connection)
+{
+	if (auto metric = find(name, connection))
+	{
+		if (metric->type == Metric::GAUGE)
+			return static_cast<MetricGauge*>(metric);
+		return gauge(get_clash_name(*metric, "gauge"), connection);
+	}
+
+	auto metric = new MetricGauge(name, connection);
+	metrics.Push(SharedPtr<Metric>(metric));
+	return metric;
+}
+
+MetricHistogram* MetricsRegistry::histogram(const String & name, std::initializer_list<float> bounds, const String & connection)
+{
+	if (auto metric = find(name, connection))
+	{
+		if (metric->type == Metric::HISTOGRAM)
+			return static_cast<MetricHistogram*>(metric);
+		return histogram(get_clash_name(*metric, "histogram"), bounds, connection);
+	}
+
+	auto metric = new MetricHistogram(name, connection, bounds);
+	metrics.Push(SharedPtr<Metric>(metric));
+	return metric;
+}
+
+void MetricsRegistry::remove_connection(const String & connection)
+{
+	for (unsigned i = 0; i < metrics.Size();)
+	{
+		if (metrics[i]->connection == connection)
+			metrics.Erase(i);
+		else
+			++i;
+	}
+}
+
+void MetricsRegistry::update()
+{
+	if (export_interval <= 0.f || export_timer.GetMSec(false) < static_cast<unsigned>(export_interval * 1000.f))
+		return;
+	export_timer.Reset();
+
+	const auto json = to_json();
+	if (export_path.Empty())
+	{
+		URHO3D_LOGINFO(json);
+		return;
+	}
+
+	// Appended a line at a time, so an interrupted process leaves the earlier exports readable
+	auto file = std::fopen(export_path.CString(), "ab");
+	if (!file)
+	{
+		URHO3D_LOGWARNING("Could not open the metrics export file " + export_path);
+		return;
+	}
+	std::fputs(json.CString(), file);
+	std::fputc('\n', file);
+	std::fclose(file);
+}
+
+String MetricsRegistry::to_json() const
+{
+	String result;
+	result.AppendWithFormat("{\"time\":%.3f,\"metrics\":[", uptime.GetMSec(false) / 1000.f);
+	for (unsigned i = 0; i < metrics.Size(); ++i)
+	{
+		if (i > 0)
+			result += ',';
+		metrics[i]->write_json(result);
+	}
+	result += "]}";
+	return result;
+}
+
+String MetricsRegistry::get_clash_name(const Metric & existing, const char * type) const
+{
+	// Suffixed with the type, so the clash can't repeat
+	const auto name = existing.name + "." + type;
+	if (!find(name, existing.connection))
+		URHO3D_LOGERROR("Metric " + existing.name + " already exists with another type, registering the " + type + " as " + name);
+	return name;
+}
+
+Metric* MetricsRegistry::find(const String & name, const String & connection) const
+{
+	for (auto& metric : metrics)
+	{
+		if (metric->name == name && metric->connection == connection)
+			return metric;
+	}
+	return nullptr;
+}
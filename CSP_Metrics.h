@@ -0,0 +1,137 @@
+#pragma once
+
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Str.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Core/Timer.h>
+#include <atomic>
+#include <initializer_list>
+
+using namespace Urho3D;
+
+
+/*
+Counters, gauges and fixed bucket histograms of the CSP server and client.
+
+Updating a metric is a relaxed atomic operation without locks or allocations, cheap enough to leave on.
+Metrics are created and removed on the main thread, usually once per connection, and keep their address until removed.
+The registry can be shared by a server and its clients in the same process.
+
+	csp_server->metrics->export_interval = 10.f;
+	csp_server->metrics->export_path = "metrics.jsonl";
+
+Each export appends one JSON object per line:
+	{"time":10.0,"metrics":[{"name":"server.snapshot_bytes","connection":"127.0.0.1:2345","type":"histogram","count":300,"sum":41250,"buckets":[[64,0],[128,12],...,["inf",0]]},...]}
+*/
+struct Metric : RefCounted
+{
+	enum Type
+	{
+		COUNTER,
+		GAUGE,
+		HISTOGRAM
+	};
+
+	Metric(Type type, const String& name, const String& connection) : type(type), name(name), connection(connection) {}
+
+	const Type type;
+	const String name;
+	// Peer the metric is about, empty for the whole server or client
+	const String connection;
+
+	// Append the metric as a JSON object
+	virtual void write_json(String& result) const = 0;
+	// Short human readable value, for the debug HUD
+	virtual String get_summary() const = 0;
+};
+
+// Monotonic total
+struct MetricCounter : Metric
+{
+	MetricCounter(const String& name, const String& connection) : Metric(COUNTER, name, connection) {}
+
+	void add(unsigned long long amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+	unsigned long long get() const { return value.load(std::memory_order_relaxed); }
+
+	void write_json(String& result) const override;
+	String get_summary() const override;
+
+protected:
+	std::atomic<unsigned long long> value{ 0 };
+};
+
+// Latest value
+struct MetricGauge : Metric
+{
+	MetricGauge(const String& name, const String& connection) : Metric(GAUGE, name, connection) {}
+
+	void set(float new_value) { value.store(new_value, std::memory_order_relaxed); }
+	float get() const { return value.load(std::memory_order_relaxed); }
+
+	void write_json(String& result) const override;
+	String get_summary() const override;
+
+protected:
+	std::atomic<float> value{ 0.f };
+};
+
+// Count of values per bucket, each bucket up to and including its bound, and one more for the values above the last bound
+struct MetricHistogram : Metric
+{
+	static constexpr unsigned MAX_BUCKETS = 16;
+
+	// Ascending bucket upper bounds, up to MAX_BUCKETS of them
+	MetricHistogram(const String& name, const String& connection, std::initializer_list<float> bounds);
+
+	void record(float value);
+
+	unsigned long long get_count() const { return count.load(std::memory_order_relaxed); }
+	double get_sum() const { return sum.load(std::memory_order_relaxed); }
+	unsigned get_num_buckets() const { return num_bounds + 1; }
+	unsigned long long get_bucket(unsigned index) const { return buckets[index].load(std::memory_order_relaxed); }
+
+	void write_json(String& result) const override;
+	String get_summary() const override;
+
+protected:
+	float bounds[MAX_BUCKETS];
+	unsigned num_bounds = 0;
+	std::atomic<unsigned long long> buckets[MAX_BUCKETS + 1];
+	std::atomic<unsigned long long> count{ 0 };
+	std::atomic<double> sum{ 0.0 };
+};
+
+
+struct MetricsRegistry : RefCounted
+{
+	// Find or create a metric by name and connection.
+	// A name taken by a metric of another type logs an error and gets the type as a suffix, like "name.gauge".
+	MetricCounter* counter(const String& name, const String& connection = String::EMPTY);
+	MetricGauge* gauge(const String& name, const String& connection = String::EMPTY);
+	MetricHistogram* histogram(const String& name, std::initializer_list<float> bounds, const String& connection = String::EMPTY);
+
+	// Remove the metrics of a connection when it's gone
+	void remove_connection(const String& connection);
+
+	const Vector<SharedPtr<Metric>>& get_metrics() const { return metrics; }
+
+	// Seconds between exports, 0 to not export
+	float export_interval = 0;
+	// File the exports are appended to, or the log if empty
+	String export_path;
+
+	// Export if the interval passed, call regularly. Safe to call from several owners.
+	void update();
+	// All the metrics as a JSON object
+	String to_json() const;
+
+protected:
+	Vector<SharedPtr<Metric>> metrics;
+	Timer export_timer;
+	mutable Timer uptime;
+
+	Metric* find(const String& name, const String& connection) const;
+	// Name for a metric of another type clashing with an existing one
+	String get_clash_name(const Metric& existing, const char* type) const;
+};
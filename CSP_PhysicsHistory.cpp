@@ -0,0 +1,278 @@
+#include "CSP_PhysicsHistory.h"
+
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/Physics/PhysicsUtils.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Node.h>
+#include <Bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorld.h>
+#include <Bullet/BulletDynamics/Dynamics/btRigidBody.h>
+
+// Exact copies, a quaternion round trip would change the replayed simulation
+static inline Matrix3 ToMatrix3(const btMatrix3x3& m)
+{
+	return Matrix3(
+		m[0].x(), m[0].y(), m[0].z(),
+		m[1].x(), m[1].y(), m[1].z(),
+		m[2].x(), m[2].y(), m[2].z());
+}
+
+static inline btMatrix3x3 ToBtMatrix3x3(const Matrix3& m)
+{
+	return btMatrix3x3(
+		m.m00_, m.m01_, m.m02_,
+		m.m10_, m.m11_, m.m12_,
+		m.m20_, m.m21_, m.m22_);
+}
+
+// ID of the body's node, Urho3D keeps the RigidBody component as the user pointer
+static inline unsigned get_node_id(const btRigidBody* body)
+{
+	auto rigid_body = static_cast<RigidBody*>(body->getUserPointer());
+	auto node = rigid_body ? rigid_body->GetNode() : nullptr;
+	return node ? node->GetID() : 0;
+}
+
+static inline bool within(const Vector3& a, const Vector3& b, float tolerance)
+{
+	return Abs(a.x_ - b.x_) <= tolerance &&
+		Abs(a.y_ - b.y_) <= tolerance &&
+		Abs(a.z_ - b.z_) <= tolerance;
+}
+
+// Call a function for each dynamic body in the world, or in the subset if there's one
+template<typename F>
+static void for_each_body(PhysicsWorld* world, const PODVector<btRigidBody*>* subset, F function)
+{
+	if (subset)
+	{
+		for (auto body : *subset)
+		{
+			if (!function(body))
+				return;
+		}
+		return;
+	}
+
+	const auto& objects = world->GetWorld()->getCollisionObjectArray();
+	for (int i = 0; i < objects.size(); ++i)
+	{
+		auto body = btRigidBody::upcast(objects[i]);
+		if (!body || body->isStaticOrKinematicObject())
+			continue;
+		if (!function(body))
+			return;
+	}
+}
+
+void PhysicsHistory::set_capacity(unsigned ticks, unsigned bodies_per_tick)
+{
+	tick_capacity = ticks;
+	body_capacity = bodies_per_tick;
+
+	tick_ids.Resize(ticks);
+	tick_saved.Resize(ticks);
+	body_counts.Resize(ticks);
+
+	const auto size = ticks * bodies_per_tick;
+	bodies.Resize(size);
+	node_ids.Resize(size);
+	positions.Resize(size);
+	rotations.Resize(size);
+	linear_velocities.Resize(size);
+	angular_velocities.Resize(size);
+	activation_states.Resize(size);
+	deactivation_times.Resize(size);
+
+	clear();
+}
+
+void PhysicsHistory::save(ID tick, PhysicsWorld * world)
+{
+	if (tick_capacity == 0)
+		return;
+
+	const auto slot = tick % tick_capacity;
+	const auto first = slot * body_capacity;
+	const auto& objects = world->GetWorld()->getCollisionObjectArray();
+
+	unsigned count = 0;
+	for (int i = 0; i < objects.size(); ++i)
+	{
+		auto body = btRigidBody::upcast(objects[i]);
+		if (!body || body->isStaticOrKinematicObject())
+			continue;
+
+		if (count == body_capacity)
+		{
+			if (!warned_capacity)
+			{
+				URHO3D_LOGWARNING("PhysicsHistory body capacity exceeded, the rest of the bodies aren't saved");
+				warned_capacity = true;
+			}
+			break;
+		}
+
+		const auto index = first + count++;
+		bodies[index] = body;
+		node_ids[index] = get_node_id(body);
+		save_body(body, index);
+	}
+
+	tick_ids[slot] = tick;
+	tick_saved[slot] = true;
+	body_counts[slot] = count;
+}
+
+bool PhysicsHistory::update(ID tick, const PODVector<btRigidBody*>& subset)
+{
+	const auto slot = find_tick(tick);
+	if (slot < 0)
+		return false;
+
+	unsigned next = 0;
+	for (auto body : subset)
+	{
+		unsigned index;
+		if (find_body(body, slot, next, index))
+			save_body(body, index);
+	}
+
+	return true;
+}
+
+bool PhysicsHistory::restore(ID tick, PhysicsWorld * world, const PODVector<btRigidBody*>* subset)
+{
+	const auto slot = find_tick(tick);
+	if (slot < 0)
+		return false;
+
+	auto bullet_world = world->GetWorld();
+	unsigned next = 0;
+
+	for_each_body(world, subset, [&](btRigidBody* body) {
+		// Created after the tick, keep its current state
+		unsigned index;
+		if (find_body(body, slot, next, index))
+		{
+			restore_body(body, index);
+			// Sleeping bodies don't get their bounds updated while stepping
+			bullet_world->updateSingleAabb(body);
+		}
+		return true;
+	});
+
+	return true;
+}
+
+bool PhysicsHistory::matches(ID tick, PhysicsWorld * world, const StateTolerance & tolerance, const PODVector<btRigidBody*>* subset) const
+{
+	const auto slot = find_tick(tick);
+	if (slot < 0)
+		return false;
+
+	bool match = true;
+	unsigned next = 0;
+
+	for_each_body(world, subset, [&](btRigidBody* body) {
+		unsigned index;
+		if (!find_body(body, slot, next, index))
+			return match = false;
+
+		const auto& transform = body->getWorldTransform();
+		if (!within(ToVector3(transform.getOrigin()), positions[index], tolerance.position) ||
+			!within(ToVector3(body->getLinearVelocity()), linear_velocities[index], tolerance.velocity) ||
+			!within(ToVector3(body->getAngularVelocity()), angular_velocities[index], tolerance.velocity))
+			return match = false;
+
+		const auto& basis = transform.getBasis();
+		const auto saved_rotation = rotations[index].Data();
+		for (int row = 0; row < 3; ++row)
+		{
+			if (!within(ToVector3(basis[row]), Vector3(saved_rotation + row * 3), tolerance.rotation))
+				return match = false;
+		}
+
+		return true;
+	});
+
+	return match;
+}
+
+void PhysicsHistory::clear()
+{
+	for (unsigned i = 0; i < tick_saved.Size(); ++i)
+		tick_saved[i] = false;
+	warned_capacity = false;
+}
+
+int PhysicsHistory::find_tick(ID tick) const
+{
+	if (tick_capacity == 0)
+		return -1;
+
+	const auto slot = tick % tick_capacity;
+	if (!tick_saved[slot] || tick_ids[slot] != tick)
+		return -1;
+
+	return static_cast<int>(slot);
+}
+
+bool PhysicsHistory::find_body(const btRigidBody * body, unsigned slot, unsigned & next, unsigned & index) const
+{
+	const auto first = slot * body_capacity;
+	const auto count = body_counts[slot];
+
+	// A removed body's memory may be reused by a new body, which is only the same body if it belongs to the same node
+	const auto node_id = get_node_id(body);
+	auto is_saved = [&](unsigned saved) { return bodies[first + saved] == body && node_ids[first + saved] == node_id; };
+
+	// Bodies keep their order unless bodies were added or removed, so check the next saved body first
+	auto saved = next;
+	if (saved >= count || !is_saved(saved))
+	{
+		for (saved = 0; saved < count; ++saved)
+		{
+			if (is_saved(saved))
+				break;
+		}
+		if (saved == count)
+			return false;
+	}
+
+	next = saved + 1;
+	index = first + saved;
+	return true;
+}
+
+void PhysicsHistory::save_body(const btRigidBody * body, unsigned index)
+{
+	const auto& transform = body->getWorldTransform();
+	positions[index] = ToVector3(transform.getOrigin());
+	rotations[index] = ToMatrix3(transform.getBasis());
+	linear_velocities[index] = ToVector3(body->getLinearVelocity());
+	angular_velocities[index] = ToVector3(body->getAngularVelocity());
+	activation_states[index] = body->getActivationState();
+	deactivation_times[index] = body->getDeactivationTime();
+}
+
+void PhysicsHistory::restore_body(btRigidBody * body, unsigned index)
+{
+	const btTransform transform(ToBtMatrix3x3(rotations[index]), ToBtVector3(positions[index]));
+	const auto linear_velocity = ToBtVector3(linear_velocities[index]);
+	const auto angular_velocity = ToBtVector3(angular_velocities[index]);
+
+	body->setWorldTransform(transform);
+	body->setInterpolationWorldTransform(transform);
+	body->setLinearVelocity(linear_velocity);
+	body->setAngularVelocity(angular_velocity);
+	body->setInterpolationLinearVelocity(linear_velocity);
+	body->setInterpolationAngularVelocity(angular_velocity);
+	body->clearForces();
+	body->forceActivationState(activation_states[index]);
+	body->setDeactivationTime(deactivation_times[index]);
+
+	// Move the node too, sleeping bodies won't do it while stepping
+	if (auto motion_state = body->getMotionState())
+		motion_state->setWorldTransform(transform);
+}
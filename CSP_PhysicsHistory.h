@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Matrix3.h>
+#include <Urho3D/Math/Vector3.h>
+
+class btRigidBody;
+
+namespace Urho3D
+{
+	class PhysicsWorld;
+}
+
+using namespace Urho3D;
+
+
+// Largest differences for a body's state to be considered the same
+struct StateTolerance
+{
+	// World units
+	float position = 0.01f;
+	// Rotation matrix elements
+	float rotation = 0.01f;
+	// World units per second, linear and angular
+	float velocity = 0.05f;
+};
+
+
+/*
+Ring buffer of the dynamic rigid body states of a whole physics world, one entry per tick.
+
+Used to rewind the world to the tick the server state refers to, so bodies that aren't in the snapshot are replayed
+from the same state they had at that tick instead of being stepped again on top of their latest state.
+
+The state is stored per body in contiguous arrays, all allocated up front by set_capacity().
+Contact caches aren't part of the state, so replay is as deterministic as restarting Bullet from the saved bodies.
+*/
+struct PhysicsHistory
+{
+	using ID = unsigned;
+
+	// Allocate memory for a number of ticks and the maximum number of dynamic bodies per tick
+	void set_capacity(unsigned ticks, unsigned bodies_per_tick);
+	unsigned get_tick_capacity() const { return tick_capacity; }
+	unsigned get_body_capacity() const { return body_capacity; }
+
+	// Save the state of all the dynamic bodies under a tick ID, overwriting the tick that was tick_capacity IDs before it
+	void save(ID tick, PhysicsWorld* world);
+	// Overwrite the saved state of a subset of the tick's bodies, keeping the rest. Returns false if the tick isn't in the history.
+	bool update(ID tick, const PODVector<btRigidBody*>& subset);
+	// Restore the saved state of the bodies that are still in the world, or only of a subset of them.
+	// Returns false if the tick isn't in the history.
+	bool restore(ID tick, PhysicsWorld* world, const PODVector<btRigidBody*>* subset = nullptr);
+	// Check if all the dynamic bodies in the world, or a subset of them, are within tolerance of their saved state.
+	// Returns false if the tick isn't in the history or a body wasn't saved.
+	bool matches(ID tick, PhysicsWorld* world, const StateTolerance& tolerance, const PODVector<btRigidBody*>* subset = nullptr) const;
+	// Forget all the saved ticks
+	void clear();
+
+protected:
+	unsigned tick_capacity = 0;
+	unsigned body_capacity = 0;
+	// Warn only once about bodies that don't fit
+	bool warned_capacity = false;
+
+	// Per tick
+	PODVector<ID> tick_ids;
+	PODVector<bool> tick_saved;
+	PODVector<unsigned> body_counts;
+
+	// Per tick and body, the tick's bodies start at tick slot * body_capacity
+	PODVector<btRigidBody*> bodies;
+	// Node of each body, telling a new body apart from a removed one at the same address
+	PODVector<unsigned> node_ids;
+	PODVector<Vector3> positions;
+	PODVector<Matrix3> rotations;
+	PODVector<Vector3> linear_velocities;
+	PODVector<Vector3> angular_velocities;
+	PODVector<int> activation_states;
+	PODVector<float> deactivation_times;
+
+	// Index of the tick's slot, or -1 if the tick isn't saved
+	int find_tick(ID tick) const;
+	// Find a body's index in a tick's slot, checking the next expected index first. Returns false if it wasn't saved.
+	bool find_body(const btRigidBody* body, unsigned slot, unsigned& next, unsigned& index) const;
+	void save_body(const btRigidBody* body, unsigned index);
+	void restore_body(btRigidBody* body, unsigned index);
+};
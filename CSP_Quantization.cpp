@@ -0,0 +1,156 @@
+#include "CSP_Quantization.h"
+
+#include "CSP_BitStream.h"
+#include <Urho3D/Math/MathDefs.h>
+#include <cmath>
+
+// Range of the smallest three quaternion components
+static constexpr float SMALLEST_THREE_MAX = 0.70710678f;
+// Largest ID increment written in short form
+static constexpr unsigned SHORT_ID_BITS = 4;
+static constexpr unsigned MAX_SHORT_ID_DELTA = 1u << SHORT_ID_BITS;
+
+unsigned quantization_bits(float range, float precision)
+{
+	if (range <= 0.f || precision <= 0.f)
+		return 1;
+
+	const auto steps = range / precision + 1.f;
+	const auto bits = static_cast<unsigned>(std::ceil(std::log2(steps)));
+	return Clamp(bits, 1u, 24u);
+}
+
+unsigned quantize(float value, float min, float max, unsigned bits)
+{
+	const auto max_value = (1u << bits) - 1;
+	const auto normalized = Clamp((value - min) / (max - min), 0.f, 1.f);
+	return static_cast<unsigned>(normalized * max_value + 0.5f);
+}
+
+float dequantize(unsigned value, float min, float max, unsigned bits)
+{
+	const auto max_value = (1u << bits) - 1;
+	return min + (max - min) * (static_cast<float>(value) / max_value);
+}
+
+
+void write_position(BitWriter & writer, const Vector3 & position, const QuantizationSettings & settings)
+{
+	const auto& min = settings.world_bounds.min_;
+	const auto& max = settings.world_bounds.max_;
+
+	for (unsigned i = 0; i < 3; ++i)
+	{
+		const auto bits = quantization_bits(max.Data()[i] - min.Data()[i], settings.position_precision);
+		writer.write_bits(quantize(position.Data()[i], min.Data()[i], max.Data()[i], bits), bits);
+	}
+}
+
+Vector3 read_position(BitReader & reader, const QuantizationSettings & settings)
+{
+	const auto& min = settings.world_bounds.min_;
+	const auto& max = settings.world_bounds.max_;
+
+	float position[3];
+	for (unsigned i = 0; i < 3; ++i)
+	{
+		const auto bits = quantization_bits(max.Data()[i] - min.Data()[i], settings.position_precision);
+		position[i] = dequantize(reader.read_bits(bits), min.Data()[i], max.Data()[i], bits);
+	}
+
+	return Vector3(position);
+}
+
+
+void write_rotation(BitWriter & writer, const Quaternion & rotation, const QuantizationSettings & settings)
+{
+	const auto normalized = rotation.Normalized();
+	const float components[4] = { normalized.w_, normalized.x_, normalized.y_, normalized.z_ };
+
+	unsigned largest = 0;
+	for (unsigned i = 1; i < 4; ++i)
+	{
+		if (Abs(components[i]) > Abs(components[largest]))
+			largest = i;
+	}
+
+	// q and -q are the same rotation, flip so the omitted component is positive
+	const auto sign = components[largest] < 0.f ? -1.f : 1.f;
+
+	writer.write_bits(largest, 2);
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		if (i != largest)
+			writer.write_bits(quantize(components[i] * sign, -SMALLEST_THREE_MAX, SMALLEST_THREE_MAX, settings.rotation_bits), settings.rotation_bits);
+	}
+}
+
+Quaternion read_rotation(BitReader & reader, const QuantizationSettings & settings)
+{
+	const auto largest = reader.read_bits(2);
+
+	float components[4];
+	float sum_squares = 0.f;
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		if (i != largest)
+		{
+			components[i] = dequantize(reader.read_bits(settings.rotation_bits), -SMALLEST_THREE_MAX, SMALLEST_THREE_MAX, settings.rotation_bits);
+			sum_squares += components[i] * components[i];
+		}
+	}
+	components[largest] = std::sqrt(Max(0.f, 1.f - sum_squares));
+
+	return Quaternion(components[0], components[1], components[2], components[3]).Normalized();
+}
+
+
+void write_velocity(BitWriter & writer, const Vector3 & velocity, float max_velocity, float precision)
+{
+	const auto bits = quantization_bits(max_velocity * 2.f, precision);
+
+	// Anything that rounds to zero is sent as zero, which is the common case for resting bodies
+	const auto moving = velocity.Length() >= precision * 0.5f;
+	writer.write_bool(moving);
+	if (!moving)
+		return;
+
+	for (unsigned i = 0; i < 3; ++i)
+		writer.write_bits(quantize(velocity.Data()[i], -max_velocity, max_velocity, bits), bits);
+}
+
+Vector3 read_velocity(BitReader & reader, float max_velocity, float precision)
+{
+	if (!reader.read_bool())
+		return Vector3::ZERO;
+
+	const auto bits = quantization_bits(max_velocity * 2.f, precision);
+
+	float velocity[3];
+	for (unsigned i = 0; i < 3; ++i)
+		velocity[i] = dequantize(reader.read_bits(bits), -max_velocity, max_velocity, bits);
+
+	return Vector3(velocity);
+}
+
+
+void write_node_id(BitWriter & writer, unsigned id, unsigned & previous_id)
+{
+	const auto id_delta = id - previous_id;
+	const auto short_id = id_delta >= 1 && id_delta <= MAX_SHORT_ID_DELTA;
+	writer.write_bool(short_id);
+	if (short_id)
+		writer.write_bits(id_delta - 1, SHORT_ID_BITS);
+	else
+		writer.write_bits(id, 32);
+	previous_id = id;
+}
+
+unsigned read_node_id(BitReader & reader, unsigned & previous_id)
+{
+	const auto id = reader.read_bool() ?
+		previous_id + reader.read_bits(SHORT_ID_BITS) + 1 :
+		reader.read_bits(32);
+	previous_id = id;
+	return id;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Urho3D/Math/BoundingBox.h>
+#include <Urho3D/Math/Quaternion.h>
+#include <Urho3D/Math/Vector3.h>
+
+struct BitReader;
+struct BitWriter;
+
+using namespace Urho3D;
+
+
+/*
+Precision settings for quantized state snapshots.
+The server's and the client's settings must match.
+*/
+struct QuantizationSettings
+{
+	// Positions are stored relative to the world bounds, positions outside of them are clamped
+	BoundingBox world_bounds = BoundingBox(Vector3(-512.f, -64.f, -512.f), Vector3(512.f, 448.f, 512.f));
+	// Position precision in world units
+	float position_precision = 1.f / 512.f;
+
+	// Bits per smallest three quaternion component
+	unsigned rotation_bits = 10;
+
+	// Linear velocity range per axis and precision
+	float max_linear_velocity = 32.f;
+	float linear_velocity_precision = 1.f / 32.f;
+
+	// Angular velocity range per axis and precision
+	float max_angular_velocity = 32.f;
+	float angular_velocity_precision = 1.f / 32.f;
+};
+
+
+// Number of bits needed to store a range at a given precision, between 1 and 24 so it's exact as float
+unsigned quantization_bits(float range, float precision);
+// Map a value in [min, max] to an integer with a given number of bits, values outside are clamped
+unsigned quantize(float value, float min, float max, unsigned bits);
+float dequantize(unsigned value, float min, float max, unsigned bits);
+
+
+/*
+Bit packed field codecs.
+Each read_* reads exactly what the matching write_* wrote with the same settings.
+*/
+// Fixed point position relative to the world bounds
+void write_position(BitWriter& writer, const Vector3& position, const QuantizationSettings& settings);
+Vector3 read_position(BitReader& reader, const QuantizationSettings& settings);
+
+// Smallest three: index of the largest component and the other three components, the largest is restored from unit length
+void write_rotation(BitWriter& writer, const Quaternion& rotation, const QuantizationSettings& settings);
+Quaternion read_rotation(BitReader& reader, const QuantizationSettings& settings);
+
+// A single bit for zero velocity, otherwise quantized per axis in [-max_velocity, max_velocity]
+void write_velocity(BitWriter& writer, const Vector3& velocity, float max_velocity, float precision);
+Vector3 read_velocity(BitReader& reader, float max_velocity, float precision);
+
+// Node ID in ascending order: 1 bit for a small increment over the previous ID followed by 4 bits of it, otherwise 32 bits
+void write_node_id(BitWriter& writer, unsigned id, unsigned& previous_id);
+unsigned read_node_id(BitReader& reader, unsigned& previous_id);
+// Upper bound of a node ID's size in bits
+constexpr unsigned MAX_NODE_ID_BITS = 1 + 32;
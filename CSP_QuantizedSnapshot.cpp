@@ -0,0 +1,153 @@
+#include "CSP_QuantizedSnapshot.h"
+
+#include "CSP_BitStream.h"
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Scene.h>
+
+static void write_node(BitWriter& writer, Node* node, unsigned& previous_id, const QuantizationSettings& settings)
+{
+	write_node_id(writer, node->GetID(), previous_id);
+
+	write_position(writer, node->GetWorldPosition(), settings);
+	write_rotation(writer, node->GetWorldRotation(), settings);
+
+	auto body = node->GetComponent<RigidBody>();
+	writer.write_bool(body != nullptr);
+	if (body)
+	{
+		write_velocity(writer, body->GetLinearVelocity(), settings.max_linear_velocity, settings.linear_velocity_precision);
+		write_velocity(writer, body->GetAngularVelocity(), settings.max_angular_velocity, settings.angular_velocity_precision);
+	}
+}
+
+void QuantizedSnapshot::add_node(Node * node)
+{
+	const auto id = node->GetID();
+
+	unsigned i = 0;
+	for (; i < nodes.Size(); ++i)
+	{
+		if (nodes[i] == node)
+			return;
+		if (nodes[i] && nodes[i]->GetID() > id)
+			break;
+	}
+
+	nodes.Insert(i, WeakPtr<Node>(node));
+}
+
+void QuantizedSnapshot::get_nodes(PODVector<Node*>& result)
+{
+	// Forget removed nodes
+	for (unsigned i = 0; i < nodes.Size();)
+	{
+		if (nodes[i])
+			++i;
+		else
+			nodes.Erase(i);
+	}
+
+	result.Clear();
+	for (auto& node : nodes)
+		result.Push(node);
+}
+
+void QuantizedSnapshot::write_state(VectorBuffer & message, Scene * scene, const QuantizationSettings & settings)
+{
+	// Forget removed nodes
+	for (unsigned i = 0; i < nodes.Size();)
+	{
+		if (nodes[i])
+			++i;
+		else
+			nodes.Erase(i);
+	}
+
+	message.WriteVLE(nodes.Size());
+
+	BitWriter writer(message);
+	unsigned previous_id = 0;
+
+	for (auto& node : nodes)
+		write_node(writer, node, previous_id, settings);
+
+	writer.flush();
+}
+
+void QuantizedSnapshot::write_state(VectorBuffer & message, const PODVector<Node*>& nodes, const QuantizationSettings & settings)
+{
+	message.WriteVLE(nodes.Size());
+
+	BitWriter writer(message);
+	unsigned previous_id = 0;
+
+	for (auto node : nodes)
+		write_node(writer, node, previous_id, settings);
+
+	writer.flush();
+}
+
+unsigned QuantizedSnapshot::get_max_node_bits(const QuantizationSettings & settings)
+{
+	const auto& min = settings.world_bounds.min_;
+	const auto& max = settings.world_bounds.max_;
+
+	unsigned bits = MAX_NODE_ID_BITS;
+	for (unsigned i = 0; i < 3; ++i)
+		bits += quantization_bits(max.Data()[i] - min.Data()[i], settings.position_precision);
+	bits += 2 + 3 * settings.rotation_bits;
+	// Rigid body and moving flags
+	bits += 1 + 2;
+	bits += 3 * quantization_bits(settings.max_linear_velocity * 2.f, settings.linear_velocity_precision);
+	bits += 3 * quantization_bits(settings.max_angular_velocity * 2.f, settings.angular_velocity_precision);
+	return bits;
+}
+
+bool QuantizedSnapshot::read_state(MemoryBuffer & message, Scene * scene, const QuantizationSettings & settings,
+	InterpolationBuffer * interpolation, unsigned tick)
+{
+	const auto count = message.ReadVLE();
+
+	BitReader reader(message);
+	unsigned previous_id = 0;
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		const auto id = read_node_id(reader, previous_id);
+
+		const auto position = read_position(reader, settings);
+		const auto rotation = read_rotation(reader, settings);
+
+		const auto has_body = reader.read_bool();
+		Vector3 linear_velocity, angular_velocity;
+		if (has_body)
+		{
+			linear_velocity = read_velocity(reader, settings.max_linear_velocity, settings.linear_velocity_precision);
+			angular_velocity = read_velocity(reader, settings.max_angular_velocity, settings.angular_velocity_precision);
+		}
+
+		if (reader.overflowed)
+			return false;
+
+		if (interpolation && interpolation->push(id, tick, position, rotation, linear_velocity))
+			continue;
+
+		auto node = scene->GetNode(id);
+		if (!node)
+			continue;
+
+		node->SetWorldPosition(position);
+		node->SetWorldRotation(rotation);
+
+		auto body = node->GetComponent<RigidBody>();
+		if (has_body && body)
+		{
+			body->SetLinearVelocity(linear_velocity);
+			body->SetAngularVelocity(angular_velocity);
+		}
+	}
+
+	return true;
+}
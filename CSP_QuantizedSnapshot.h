@@ -0,0 +1,54 @@
+#pragma once
+
+#include "CSP_Interpolation.h"
+#include "CSP_Quantization.h"
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+
+namespace Urho3D
+{
+	class MemoryBuffer;
+	class Node;
+	class Scene;
+	class VectorBuffer;
+}
+
+using namespace Urho3D;
+
+
+/*
+Compact state snapshot of node transforms and rigid body velocities.
+
+Unlike StateSnapshot it only carries the transform and velocities, so the nodes need to already exist on the client,
+for example through Urho's scene replication. Nodes the client doesn't have are skipped.
+
+serialization structure:
+- node count (VLE)
+- bit packed nodes:
+	- node ID, see write_node_id()
+	- world position, quantized relative to the world bounds
+	- world rotation, smallest three
+	- 1 bit for having a rigid body, followed by its quantized linear and angular velocities
+*/
+struct QuantizedSnapshot
+{
+	// Add a node to the snapshot
+	void add_node(Node* node);
+	// Get the snapshot's nodes in ascending ID order
+	void get_nodes(PODVector<Node*>& result);
+
+	// Write all the snapshot's nodes
+	void write_state(VectorBuffer& message, Scene* scene, const QuantizationSettings& settings);
+	// Write a subset of the nodes, in ascending ID order
+	static void write_state(VectorBuffer& message, const PODVector<Node*>& nodes, const QuantizationSettings& settings);
+	// Upper bound of a node's size in bits
+	static unsigned get_max_node_bits(const QuantizationSettings& settings);
+	// Read and apply the state of the nodes existing in the scene. Returns false if the state is malformed.
+	// The states of the nodes in an interpolation buffer are buffered under the state's server tick instead.
+	bool read_state(MemoryBuffer& message, Scene* scene, const QuantizationSettings& settings,
+		InterpolationBuffer* interpolation = nullptr, unsigned tick = 0);
+
+protected:
+	// Nodes to be serialized, in ascending ID order for compact IDs
+	Vector<WeakPtr<Node>> nodes;
+};
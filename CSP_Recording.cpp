@@ -0,0 +1,425 @@
+#include "CSP_Recording.h"
+
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/Math/MathDefs.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File header: ID, version and timestep
+static const unsigned HEADER_SIZE = 12;
+// Chunk header: ID, payload size, record count, first and last tick
+static const unsigned CHUNK_HEADER_SIZE = 20;
+// Footer: index offset and ID
+static const unsigned FOOTER_SIZE = 12;
+
+bool Recorder::open(const String & path, float timestep)
+{
+	close();
+
+	file = std::fopen(path.CString(), "wb");
+	if (!file)
+	{
+		URHO3D_LOGWARNING("Could not open the recording file " + path);
+		return false;
+	}
+	file_offset = 0;
+	records = 0;
+	bytes = 0;
+
+	VectorBuffer header;
+	header.WriteFileID("CSPR");
+	header.WriteUInt(Recording::VERSION);
+	header.WriteFloat(timestep);
+	write(header.GetData(), header.GetSize());
+	return true;
+}
+
+void Recorder::close()
+{
+	if (!file)
+		return;
+
+	flush_chunk();
+
+	VectorBuffer index_buffer;
+	index_buffer.WriteFileID("CIDX");
+	index_buffer.WriteVLE(peer_names.Size());
+	for (auto& name : peer_names)
+		index_buffer.WriteString(name);
+	index_buffer.WriteVLE(index.Size());
+	for (auto& entry : index)
+	{
+		index_buffer.WriteUInt64(entry.offset);
+		index_buffer.WriteUInt(entry.first_tick);
+		index_buffer.WriteUInt(entry.last_tick);
+	}
+	index_buffer.WriteUInt64(file_offset);
+	index_buffer.WriteFileID("CEND");
+	write(index_buffer.GetData(), index_buffer.GetSize());
+
+	std::fclose(file);
+	file = nullptr;
+
+	peers.Clear();
+	peer_names.Clear();
+	index.Clear();
+}
+
+void Recorder::record(ID tick, const String & peer, int message_id, const void * data, unsigned size)
+{
+	if (!file)
+		return;
+
+	auto it = peers.Find(peer);
+	if (it == peers.End())
+	{
+		it = peers.Insert(MakePair(peer, peer_names.Size()));
+		peer_names.Push(peer);
+		write_record(tick, it->second_, Recording::RECORD_PEER, peer.CString(), peer.Length());
+	}
+
+	write_record(tick, it->second_, message_id, data, size);
+	++records;
+	bytes += size;
+}
+
+void Recorder::write_record(ID tick, unsigned peer, int message_id, const void * data, unsigned size)
+{
+	if (chunk_records == 0)
+		chunk_first_tick = tick;
+	chunk_last_tick = tick;
+	++chunk_records;
+
+	chunk.WriteUInt(tick);
+	chunk.WriteVLE(peer);
+	chunk.WriteVLE(static_cast<unsigned>(message_id));
+	chunk.WriteVLE(size);
+	chunk.Write(data, size);
+
+	if (chunk.GetSize() >= chunk_size)
+		flush_chunk();
+}
+
+void Recorder::flush_chunk()
+{
+	if (chunk_records == 0)
+		return;
+
+	index.Push({ file_offset, chunk_first_tick, chunk_last_tick });
+
+	VectorBuffer header;
+	header.WriteFileID("CHNK");
+	header.WriteUInt(chunk.GetSize());
+	header.WriteUInt(chunk_records);
+	header.WriteUInt(chunk_first_tick);
+	header.WriteUInt(chunk_last_tick);
+	write(header.GetData(), header.GetSize());
+	write(chunk.GetData(), chunk.GetSize());
+
+	// Whole chunks reach the disk, so a crash doesn't leave a torn one behind the flushed ones
+	std::fflush(file);
+
+	chunk.Clear();
+	chunk_records = 0;
+}
+
+void Recorder::write(const void * data, unsigned size)
+{
+	if (size > 0 && std::fwrite(data, size, 1, file) != 1)
+		URHO3D_LOGWARNING("Could not write to the recording");
+	file_offset += size;
+}
+
+
+bool RecordingPlayer::open(const String & path)
+{
+	close();
+
+#ifdef _WIN32
+	auto file = CreateFileW(WString(path).CString(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		URHO3D_LOGWARNING("Could not open the recording " + path);
+		return false;
+	}
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+	{
+		mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping_handle)
+		{
+			data = static_cast<const unsigned char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+			size = static_cast<unsigned long long>(file_size.QuadPart);
+		}
+	}
+#else
+	const auto file = ::open(path.CString(), O_RDONLY);
+	if (file < 0)
+	{
+		URHO3D_LOGWARNING("Could not open the recording " + path);
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0)
+	{
+		auto mapped = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapped != MAP_FAILED)
+		{
+			data = static_cast<const unsigned char*>(mapped);
+			size = static_cast<unsigned long long>(file_stat.st_size);
+		}
+	}
+	// The mapping stays valid without the descriptor
+	::close(file);
+#endif
+
+	if (!data || size < HEADER_SIZE)
+	{
+		URHO3D_LOGWARNING("Could not map the recording " + path);
+		close();
+		return false;
+	}
+
+	MemoryBuffer header(data, HEADER_SIZE);
+	if (header.ReadFileID() != "CSPR" || header.ReadUInt() != Recording::VERSION)
+	{
+		URHO3D_LOGWARNING(path + " isn't a recording of this version");
+		close();
+		return false;
+	}
+	timestep = header.ReadFloat();
+
+	if (!read_index())
+	{
+		URHO3D_LOGWARNING(path + " has no index, scanning it");
+		scan();
+	}
+
+	enter_chunk(0);
+	return true;
+}
+
+void RecordingPlayer::close()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+#else
+	if (data)
+		munmap(const_cast<unsigned char*>(data), static_cast<size_t>(size));
+#endif
+
+	data = nullptr;
+	size = 0;
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+
+	peer_names.Clear();
+	chunks.Clear();
+	chunk_index = 0;
+	position = 0;
+	chunk_end = 0;
+	has_pending = false;
+	play_ticks = 0;
+}
+
+void RecordingPlayer::seek(ID tick)
+{
+	has_pending = false;
+
+	// Chunks are in tick order, the first one ending at the tick or later holds its first record. Handle range looping correctly
+	unsigned index = 0;
+	while (index < chunks.Size() && int(chunks[index].last_tick - tick) < 0)
+		++index;
+	enter_chunk(index);
+
+	Record record;
+	while (next(record))
+	{
+		if (int(record.tick - tick) >= 0)
+		{
+			pending = record;
+			has_pending = true;
+			break;
+		}
+	}
+
+	play_ticks = static_cast<float>(int(tick - get_first_tick()));
+}
+
+bool RecordingPlayer::next(Record & record)
+{
+	if (has_pending)
+	{
+		record = pending;
+		has_pending = false;
+		return true;
+	}
+
+	while (chunk_index < chunks.Size())
+	{
+		if (read_record(record))
+		{
+			// Peer names are known from the index or the scan
+			if (record.message_id == Recording::RECORD_PEER)
+				continue;
+			return true;
+		}
+		enter_chunk(chunk_index + 1);
+	}
+
+	return false;
+}
+
+void RecordingPlayer::play(ID until_tick, const Handler & handler)
+{
+	Record record;
+	while (next(record))
+	{
+		// Handle range looping correctly
+		if (int(record.tick - until_tick) > 0)
+		{
+			pending = record;
+			has_pending = true;
+			return;
+		}
+		handler(record);
+	}
+}
+
+void RecordingPlayer::update(float time_step, const Handler & handler)
+{
+	if (timestep <= 0.f)
+		return;
+
+	play_ticks += time_step * speed / timestep;
+	play(get_first_tick() + static_cast<ID>(play_ticks), handler);
+}
+
+bool RecordingPlayer::read_index()
+{
+	if (size < HEADER_SIZE + FOOTER_SIZE)
+		return false;
+
+	MemoryBuffer footer(data + size - FOOTER_SIZE, FOOTER_SIZE);
+	const auto index_offset = footer.ReadUInt64();
+	if (footer.ReadFileID() != "CEND" || index_offset < HEADER_SIZE || index_offset >= size - FOOTER_SIZE)
+		return false;
+
+	MemoryBuffer index(data + index_offset, static_cast<unsigned>(size - FOOTER_SIZE - index_offset));
+	if (index.ReadFileID() != "CIDX")
+		return false;
+
+	const auto peer_count = index.ReadVLE();
+	for (unsigned i = 0; i < peer_count && !index.IsEof(); ++i)
+		peer_names.Push(index.ReadString());
+
+	const auto chunk_count = index.ReadVLE();
+	for (unsigned i = 0; i < chunk_count && !index.IsEof(); ++i)
+	{
+		Recording::ChunkEntry entry;
+		entry.offset = index.ReadUInt64();
+		entry.first_tick = index.ReadUInt();
+		entry.last_tick = index.ReadUInt();
+		if (entry.offset + CHUNK_HEADER_SIZE > index_offset)
+			break;
+		chunks.Push(entry);
+	}
+
+	if (chunks.Size() != chunk_count || peer_names.Size() != peer_count)
+	{
+		peer_names.Clear();
+		chunks.Clear();
+		return false;
+	}
+
+	return true;
+}
+
+void RecordingPlayer::scan()
+{
+	auto offset = static_cast<unsigned long long>(HEADER_SIZE);
+	while (offset + CHUNK_HEADER_SIZE <= size)
+	{
+		MemoryBuffer header(data + offset, CHUNK_HEADER_SIZE);
+		if (header.ReadFileID() != "CHNK")
+			break;
+		const auto payload = header.ReadUInt();
+		header.ReadUInt();
+		const auto first_tick = header.ReadUInt();
+		const auto last_tick = header.ReadUInt();
+
+		// The chunk being written when the recording stopped
+		if (offset + CHUNK_HEADER_SIZE + payload > size)
+			break;
+
+		chunks.Push({ offset, first_tick, last_tick });
+
+		// Peers are named in their first record, in index order
+		enter_chunk(chunks.Size() - 1);
+		Record record;
+		while (read_record(record))
+		{
+			if (record.message_id == Recording::RECORD_PEER && record.peer == peer_names.Size())
+				peer_names.Push(String(reinterpret_cast<const char*>(record.data), record.size));
+		}
+
+		offset += CHUNK_HEADER_SIZE + payload;
+	}
+}
+
+void RecordingPlayer::enter_chunk(unsigned index)
+{
+	chunk_index = index;
+	if (index >= chunks.Size())
+	{
+		position = chunk_end = 0;
+		return;
+	}
+
+	MemoryBuffer header(data + chunks[index].offset, CHUNK_HEADER_SIZE);
+	header.ReadFileID();
+	const auto payload = header.ReadUInt();
+	position = chunks[index].offset + CHUNK_HEADER_SIZE;
+	chunk_end = Min(position + payload, size);
+}
+
+bool RecordingPlayer::read_record(Record & record)
+{
+	if (position >= chunk_end)
+		return false;
+
+	MemoryBuffer buffer(data + position, static_cast<unsigned>(chunk_end - position));
+	record.tick = buffer.ReadUInt();
+	record.peer = buffer.ReadVLE();
+	record.message_id = static_cast<int>(buffer.ReadVLE());
+	record.size = buffer.ReadVLE();
+
+	const auto data_offset = position + buffer.GetPosition();
+	if (data_offset + record.size > chunk_end)
+	{
+		// Malformed, skip the rest of the chunk
+		position = chunk_end;
+		return false;
+	}
+
+	record.data = data + data_offset;
+	position = data_offset + record.size;
+	return true;
+}
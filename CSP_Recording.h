@@ -0,0 +1,185 @@
+#pragma once
+
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Str.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <cstdio>
+#include <functional>
+
+using namespace Urho3D;
+
+
+/*
+Recordings of the server's traffic: the input messages it received and the state messages it sent, by server tick.
+
+Recorder appends them to a file, RecordingPlayer maps a recording to memory and hands the messages back,
+to reproduce desyncs and profile reconciliation on real traffic offline.
+
+	csp_server->recorder = new Recorder();
+	csp_server->recorder->open("session.cspr", csp_server->timestep);
+
+file structure, little endian:
+- header: "CSPR", version (UInt), timestep (Float)
+- chunks, each written whole:
+	- "CHNK", payload size, record count, first tick, last tick (UInts)
+	- records:
+		- server tick (UInt)
+		- peer index (VLE), in order of the peers' first record
+		- message ID (VLE), RECORD_PEER names a new peer
+		- data size (VLE)
+		- data, the message as sent or received
+- index, written when closing:
+	- "CIDX", peer count (VLE), peer names (String)
+	- chunk count (VLE), each chunk's offset (UInt64), first tick, last tick (UInts)
+- footer: index offset (UInt64), "CEND"
+A recording cut short by a crash has no index and is scanned instead, losing at most the chunk being filled.
+*/
+struct Recording
+{
+	using ID = unsigned;
+
+	static constexpr unsigned VERSION = 1;
+	// Message ID of the record naming a new peer
+	static constexpr int RECORD_PEER = 0;
+
+	struct ChunkEntry
+	{
+		unsigned long long offset;
+		ID first_tick;
+		ID last_tick;
+	};
+};
+
+
+/*
+Streams messages into an append-only recording, a chunk at a time.
+*/
+struct Recorder : RefCounted
+{
+	using ID = Recording::ID;
+
+	~Recorder() override { close(); }
+
+	// Start a new recording, overwriting the file. The timestep paces real time playback.
+	bool open(const String& path, float timestep);
+	// Write the last chunk and the index
+	void close();
+	bool is_open() const { return file != nullptr; }
+
+	// Record a message received from or sent to a peer at a server tick
+	void record(ID tick, const String& peer, int message_id, const void* data, unsigned size);
+
+	// Chunks are written once their records reach this many bytes
+	unsigned chunk_size = 64 * 1024;
+
+	// Records and bytes recorded
+	unsigned records = 0;
+	unsigned long long bytes = 0;
+
+protected:
+	FILE* file = nullptr;
+	unsigned long long file_offset = 0;
+
+	// Peer indices by name
+	HashMap<String, unsigned> peers;
+	Vector<String> peer_names;
+
+	// Records of the chunk being filled
+	VectorBuffer chunk;
+	unsigned chunk_records = 0;
+	ID chunk_first_tick = 0;
+	ID chunk_last_tick = 0;
+	PODVector<Recording::ChunkEntry> index;
+
+	void write_record(ID tick, unsigned peer, int message_id, const void* data, unsigned size);
+	void flush_chunk();
+	void write(const void* data, unsigned size);
+};
+
+
+/*
+Plays a recording back from memory, mapped read-only so long recordings don't need to be loaded.
+
+Records are handed out in recorded order. Feed them as fast as wanted with play(), or paced by the recording's ticks with update():
+
+	player.play(csp_server->get_tick(), [&](const RecordingPlayer::Record& record) {
+		MemoryBuffer message(record.data, record.size);
+		if (record.message_id == MSG_CSP_INPUT)
+			csp_server->receive_message(connections[record.peer], record.message_id, message);
+		else
+			clients[record.peer]->receive_message(record.message_id, message);
+	});
+*/
+struct RecordingPlayer
+{
+	using ID = Recording::ID;
+
+	struct Record
+	{
+		ID tick;
+		unsigned peer;
+		int message_id;
+		const unsigned char* data;
+		unsigned size;
+	};
+	using Handler = std::function<void(const Record& record)>;
+
+	RecordingPlayer() = default;
+	~RecordingPlayer() { close(); }
+	RecordingPlayer(const RecordingPlayer&) = delete;
+	RecordingPlayer& operator=(const RecordingPlayer&) = delete;
+
+	// Map a recording and read its index, or scan its chunks if it has none. Returns false if it isn't a recording.
+	bool open(const String& path);
+	void close();
+	bool is_open() const { return data != nullptr; }
+
+	float get_timestep() const { return timestep; }
+	// Names of the recorded peers, by peer index
+	const Vector<String>& get_peers() const { return peer_names; }
+	ID get_first_tick() const { return chunks.Empty() ? 0 : chunks.Front().first_tick; }
+	ID get_last_tick() const { return chunks.Empty() ? 0 : chunks.Back().last_tick; }
+
+	// Continue from the first record of a tick or later
+	void seek(ID tick);
+	// Read the next record. Returns false at the end.
+	bool next(Record& record);
+	// Hand out the records up to and including a tick
+	void play(ID until_tick, const Handler& handler);
+
+	// Playback speed of update(), 2 for twice real time
+	float speed = 1.f;
+	// Advance the playback by a frame's time and hand out the records which became due
+	void update(float time_step, const Handler& handler);
+
+protected:
+	const unsigned char* data = nullptr;
+	unsigned long long size = 0;
+	// Platform mapping handles
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+
+	float timestep = 0;
+	Vector<String> peer_names;
+	PODVector<Recording::ChunkEntry> chunks;
+
+	// Read position: the current chunk, the offset of the next record in it, and the chunk's end
+	unsigned chunk_index = 0;
+	unsigned long long position = 0;
+	unsigned long long chunk_end = 0;
+	// Record read ahead by play()
+	Record pending;
+	bool has_pending = false;
+	// Playback time of update(), in ticks since the first tick
+	float play_ticks = 0;
+
+	// Read the index at the end of the file. Returns false if there is none.
+	bool read_index();
+	// Build the chunk list and the peers by scanning the records
+	void scan();
+	// Move the read position to the start of a chunk's records
+	void enter_chunk(unsigned index);
+	// Read a record at the read position within the current chunk
+	bool read_record(Record& record);
+};
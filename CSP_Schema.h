@@ -0,0 +1,300 @@
+#pragma once
+
+#include "CSP_BitStream.h"
+#include "CSP_Quantization.h"
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Scene.h>
+
+using namespace Urho3D;
+
+
+/*
+Compile time schemas of the replicated fields of the networked nodes.
+
+A schema lists fields, each pairing how to reach a value of the node or one of its components with a codec quantizing it.
+The fields are read and written with direct calls, without Variant boxing or attribute lookups.
+As with QuantizedSnapshot the nodes need to already exist on the client.
+
+	// A custom component attribute accessor
+	struct Health
+	{
+		using Component = Player;
+		static float get(const Player* player) { return player->health; }
+		static void set(Player* player, float health) { player->health = health; }
+	};
+
+	using PlayerSchema = StateSchema<
+		WorldPositionField<>,
+		WorldRotationField<>,
+		ComponentField<LinearVelocity, LinearVelocityCodec>,
+		ComponentField<Health, FloatCodec<0, 100, 7>>>;
+
+	csp_server->state_schema = csp_client->state_schema = std::make_shared<PlayerSchema>();
+
+serialization structure:
+- node count (VLE)
+- bit packed nodes:
+	- node ID, see write_node_id()
+	- each field in order, component fields after a bit for the component existing
+*/
+
+
+/*
+Codecs: the value type, its bits, and the upper bound of its size.
+*/
+struct PositionCodec
+{
+	using Value = Vector3;
+	static void write(BitWriter& writer, const Vector3& value, const QuantizationSettings& settings) { write_position(writer, value, settings); }
+	static Vector3 read(BitReader& reader, const QuantizationSettings& settings) { return read_position(reader, settings); }
+	static unsigned max_bits(const QuantizationSettings& settings)
+	{
+		const auto size = settings.world_bounds.Size();
+		return quantization_bits(size.x_, settings.position_precision) +
+			quantization_bits(size.y_, settings.position_precision) +
+			quantization_bits(size.z_, settings.position_precision);
+	}
+};
+
+struct RotationCodec
+{
+	using Value = Quaternion;
+	static void write(BitWriter& writer, const Quaternion& value, const QuantizationSettings& settings) { write_rotation(writer, value, settings); }
+	static Quaternion read(BitReader& reader, const QuantizationSettings& settings) { return read_rotation(reader, settings); }
+	static unsigned max_bits(const QuantizationSettings& settings) { return 2 + 3 * settings.rotation_bits; }
+};
+
+struct LinearVelocityCodec
+{
+	using Value = Vector3;
+	static void write(BitWriter& writer, const Vector3& value, const QuantizationSettings& settings)
+	{
+		write_velocity(writer, value, settings.max_linear_velocity, settings.linear_velocity_precision);
+	}
+	static Vector3 read(BitReader& reader, const QuantizationSettings& settings)
+	{
+		return read_velocity(reader, settings.max_linear_velocity, settings.linear_velocity_precision);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings)
+	{
+		return 1 + 3 * quantization_bits(settings.max_linear_velocity * 2.f, settings.linear_velocity_precision);
+	}
+};
+
+struct AngularVelocityCodec
+{
+	using Value = Vector3;
+	static void write(BitWriter& writer, const Vector3& value, const QuantizationSettings& settings)
+	{
+		write_velocity(writer, value, settings.max_angular_velocity, settings.angular_velocity_precision);
+	}
+	static Vector3 read(BitReader& reader, const QuantizationSettings& settings)
+	{
+		return read_velocity(reader, settings.max_angular_velocity, settings.angular_velocity_precision);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings)
+	{
+		return 1 + 3 * quantization_bits(settings.max_angular_velocity * 2.f, settings.angular_velocity_precision);
+	}
+};
+
+// Float in [Min, Max] with a number of bits, values outside are clamped
+template<int Min, int Max, unsigned Bits>
+struct FloatCodec
+{
+	static_assert(Min < Max && Bits >= 1 && Bits <= 24, "FloatCodec needs a range and 1 to 24 bits");
+
+	using Value = float;
+	static void write(BitWriter& writer, float value, const QuantizationSettings&) { writer.write_bits(quantize(value, Min, Max, Bits), Bits); }
+	static float read(BitReader& reader, const QuantizationSettings&) { return dequantize(reader.read_bits(Bits), Min, Max, Bits); }
+	static unsigned max_bits(const QuantizationSettings&) { return Bits; }
+};
+
+// Unsigned integer with a number of bits, higher bits are dropped
+template<unsigned Bits>
+struct UIntCodec
+{
+	static_assert(Bits >= 1 && Bits <= 32, "UIntCodec needs 1 to 32 bits");
+
+	using Value = unsigned;
+	static void write(BitWriter& writer, unsigned value, const QuantizationSettings&) { writer.write_bits(value, Bits); }
+	static unsigned read(BitReader& reader, const QuantizationSettings&) { return reader.read_bits(Bits); }
+	static unsigned max_bits(const QuantizationSettings&) { return Bits; }
+};
+
+struct BoolCodec
+{
+	using Value = bool;
+	static void write(BitWriter& writer, bool value, const QuantizationSettings&) { writer.write_bool(value); }
+	static bool read(BitReader& reader, const QuantizationSettings&) { return reader.read_bool(); }
+	static unsigned max_bits(const QuantizationSettings&) { return 1; }
+};
+
+
+/*
+Component accessors: the component type and static get and set of a value.
+*/
+struct LinearVelocity
+{
+	using Component = RigidBody;
+	static Vector3 get(const RigidBody* body) { return body->GetLinearVelocity(); }
+	static void set(RigidBody* body, const Vector3& velocity) { body->SetLinearVelocity(velocity); }
+};
+
+struct AngularVelocity
+{
+	using Component = RigidBody;
+	static Vector3 get(const RigidBody* body) { return body->GetAngularVelocity(); }
+	static void set(RigidBody* body, const Vector3& velocity) { body->SetAngularVelocity(velocity); }
+};
+
+
+/*
+Fields: write a node's value, read one and apply it to the node if there is one.
+*/
+template<typename Codec = PositionCodec>
+struct WorldPositionField
+{
+	static void write(BitWriter& writer, Node* node, const QuantizationSettings& settings) { Codec::write(writer, node->GetWorldPosition(), settings); }
+	static void read(BitReader& reader, Node* node, const QuantizationSettings& settings)
+	{
+		const auto value = Codec::read(reader, settings);
+		if (node)
+			node->SetWorldPosition(value);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings) { return Codec::max_bits(settings); }
+};
+
+template<typename Codec = RotationCodec>
+struct WorldRotationField
+{
+	static void write(BitWriter& writer, Node* node, const QuantizationSettings& settings) { Codec::write(writer, node->GetWorldRotation(), settings); }
+	static void read(BitReader& reader, Node* node, const QuantizationSettings& settings)
+	{
+		const auto value = Codec::read(reader, settings);
+		if (node)
+			node->SetWorldRotation(value);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings) { return Codec::max_bits(settings); }
+};
+
+// A value of the node's first component of the accessor's type, after a bit for the component existing
+template<typename Accessor, typename Codec>
+struct ComponentField
+{
+	using Component = typename Accessor::Component;
+
+	static void write(BitWriter& writer, Node* node, const QuantizationSettings& settings)
+	{
+		auto component = node->GetComponent<Component>();
+		writer.write_bool(component != nullptr);
+		if (component)
+			Codec::write(writer, Accessor::get(component), settings);
+	}
+	static void read(BitReader& reader, Node* node, const QuantizationSettings& settings)
+	{
+		if (!reader.read_bool())
+			return;
+		const auto value = Codec::read(reader, settings);
+		auto component = node ? node->GetComponent<Component>() : nullptr;
+		if (component)
+			Accessor::set(component, value);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings) { return 1 + Codec::max_bits(settings); }
+};
+
+
+// Field list expanded at compile time
+template<typename... Fields>
+struct FieldList;
+
+template<>
+struct FieldList<>
+{
+	static void write(BitWriter&, Node*, const QuantizationSettings&) {}
+	static void read(BitReader&, Node*, const QuantizationSettings&) {}
+	static unsigned max_bits(const QuantizationSettings&) { return 0; }
+};
+
+template<typename Field, typename... Rest>
+struct FieldList<Field, Rest...>
+{
+	static void write(BitWriter& writer, Node* node, const QuantizationSettings& settings)
+	{
+		Field::write(writer, node, settings);
+		FieldList<Rest...>::write(writer, node, settings);
+	}
+	static void read(BitReader& reader, Node* node, const QuantizationSettings& settings)
+	{
+		Field::read(reader, node, settings);
+		FieldList<Rest...>::read(reader, node, settings);
+	}
+	static unsigned max_bits(const QuantizationSettings& settings)
+	{
+		return Field::max_bits(settings) + FieldList<Rest...>::max_bits(settings);
+	}
+};
+
+
+/*
+Serializer of a schema, called once per state so the per node and per field code is specialized for the schema.
+*/
+struct StateSerializer
+{
+	virtual ~StateSerializer() = default;
+
+	// Write nodes in ascending ID order
+	virtual void write_state(VectorBuffer& message, const PODVector<Node*>& nodes, const QuantizationSettings& settings) const = 0;
+	// Read and apply the state of the nodes existing in the scene. Returns false if the state is malformed.
+	virtual bool read_state(MemoryBuffer& message, Scene* scene, const QuantizationSettings& settings) const = 0;
+	// Upper bound of a node's size in bits
+	virtual unsigned get_max_node_bits(const QuantizationSettings& settings) const = 0;
+};
+
+template<typename... Fields>
+struct StateSchema final : StateSerializer
+{
+	void write_state(VectorBuffer& message, const PODVector<Node*>& nodes, const QuantizationSettings& settings) const override
+	{
+		message.WriteVLE(nodes.Size());
+
+		BitWriter writer(message);
+		unsigned previous_id = 0;
+
+		for (auto node : nodes)
+		{
+			write_node_id(writer, node->GetID(), previous_id);
+			FieldList<Fields...>::write(writer, node, settings);
+		}
+
+		writer.flush();
+	}
+
+	bool read_state(MemoryBuffer& message, Scene* scene, const QuantizationSettings& settings) const override
+	{
+		const auto count = message.ReadVLE();
+
+		BitReader reader(message);
+		unsigned previous_id = 0;
+
+		for (unsigned i = 0; i < count; ++i)
+		{
+			// Fields of nodes the client doesn't have are read and dropped
+			const auto id = read_node_id(reader, previous_id);
+			FieldList<Fields...>::read(reader, scene->GetNode(id), settings);
+
+			if (reader.overflowed)
+				return false;
+		}
+
+		return true;
+	}
+
+	unsigned get_max_node_bits(const QuantizationSettings& settings) const override
+	{
+		return MAX_NODE_ID_BITS + FieldList<Fields...>::max_bits(settings);
+	}
+};
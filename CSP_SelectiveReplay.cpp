@@ -0,0 +1,154 @@
+#include "CSP_SelectiveReplay.h"
+
+#include <Urho3D/Physics/PhysicsUtils.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Physics/RigidBody.h>
+#include <Urho3D/Scene/Node.h>
+#include <Bullet/BulletCollision/BroadphaseCollision/btBroadphaseInterface.h>
+#include <Bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorld.h>
+#include <Bullet/BulletDynamics/Dynamics/btRigidBody.h>
+
+static inline bool is_dynamic(const btRigidBody* body)
+{
+	return body && !body->isStaticOrKinematicObject();
+}
+
+void SelectiveReplay::add_node(Node * node)
+{
+	if (!nodes.Contains(WeakPtr<Node>(node)))
+		nodes.Push(WeakPtr<Node>(node));
+}
+
+void SelectiveReplay::remove_node(Node * node)
+{
+	nodes.Remove(WeakPtr<Node>(node));
+}
+
+// Collects the dynamic bodies whose broadphase bounds overlap a box
+struct DynamicBodiesCallback : btBroadphaseAabbCallback
+{
+	PODVector<btRigidBody*>& result;
+
+	explicit DynamicBodiesCallback(PODVector<btRigidBody*>& result) : result(result) {}
+
+	bool process(const btBroadphaseProxy* proxy) override
+	{
+		auto body = btRigidBody::upcast(static_cast<btCollisionObject*>(proxy->m_clientObject));
+		if (is_dynamic(body))
+			result.Push(body);
+		return true;
+	}
+};
+
+// Query the broadphase directly, PhysicsWorld::GetRigidBodies() runs a contact test with a temporary body
+static void get_dynamic_bodies(PhysicsWorld* world, const btVector3& aabb_min, const btVector3& aabb_max, PODVector<btRigidBody*>& result)
+{
+	result.Clear();
+	DynamicBodiesCallback callback(result);
+	world->GetWorld()->getBroadphase()->aabbTest(aabb_min, aabb_max, callback);
+}
+
+void SelectiveReplay::collect(PhysicsWorld * world, float duration)
+{
+	bodies.Clear();
+	body_set.Clear();
+	island_tags.Clear();
+
+	for (auto& node : nodes)
+	{
+		if (!node)
+			continue;
+		auto rigid_body = node->GetComponent<RigidBody>();
+		if (!rigid_body || !is_dynamic(rigid_body->GetBody()))
+			continue;
+
+		auto body = rigid_body->GetBody();
+		add_body(body);
+
+		const auto island_tag = body->getIslandTag();
+		if (island_tag >= 0 && !island_tags.Contains(island_tag))
+			island_tags.Push(island_tag);
+
+		// Bodies the predicted body can reach during the replay
+		btVector3 aabb_min, aabb_max;
+		body->getAabb(aabb_min, aabb_max);
+		const auto reach = body->getLinearVelocity().length() * duration + margin;
+		const btVector3 reach_extent(reach, reach, reach);
+
+		get_dynamic_bodies(world, aabb_min - reach_extent, aabb_max + reach_extent, nearby_bodies);
+		for (auto nearby_body : nearby_bodies)
+			add_body(nearby_body);
+	}
+
+	// Bodies simulated together with the predicted bodies in the last step.
+	// An island is made of touching bodies, so it is grown from the collected bodies through broadphase queries.
+	if (island_tags.Empty())
+		return;
+
+	for (unsigned i = 0; i < bodies.Size(); ++i)
+	{
+		auto body = bodies[i];
+		if (!island_tags.Contains(body->getIslandTag()))
+			continue;
+
+		btVector3 aabb_min, aabb_max;
+		body->getAabb(aabb_min, aabb_max);
+		const btVector3 touch_extent(M_EPSILON, M_EPSILON, M_EPSILON);
+
+		get_dynamic_bodies(world, aabb_min - touch_extent, aabb_max + touch_extent, nearby_bodies);
+		for (auto touching : nearby_bodies)
+		{
+			if (island_tags.Contains(touching->getIslandTag()))
+				add_body(touching);
+		}
+	}
+}
+
+void SelectiveReplay::freeze(PhysicsWorld * world)
+{
+	frozen_bodies.Clear();
+
+	const auto& objects = world->GetWorld()->getCollisionObjectArray();
+	for (int i = 0; i < objects.size(); ++i)
+	{
+		auto body = btRigidBody::upcast(objects[i]);
+		// Sleeping bodies are not integrated and stay in place unless touched by a replayed body,
+		// which only happens to bodies near the replay path, and those are replayed.
+		if (!is_dynamic(body) || !body->isActive() || body_set.Contains(body))
+			continue;
+
+		FrozenBody frozen;
+		frozen.body = body;
+		frozen.activation_state = body->getActivationState();
+		frozen.deactivation_time = body->getDeactivationTime();
+		frozen.linear_velocity = ToVector3(body->getLinearVelocity());
+		frozen.angular_velocity = ToVector3(body->getAngularVelocity());
+		frozen_bodies.Push(frozen);
+
+		// Not integrated, but still collides with the replayed bodies
+		body->forceActivationState(DISABLE_SIMULATION);
+	}
+}
+
+void SelectiveReplay::unfreeze()
+{
+	// The solver may have changed the velocities of frozen bodies in contact with replayed ones
+	for (auto& frozen : frozen_bodies)
+	{
+		auto body = frozen.body;
+		body->forceActivationState(frozen.activation_state);
+		body->setDeactivationTime(frozen.deactivation_time);
+		body->setLinearVelocity(ToBtVector3(frozen.linear_velocity));
+		body->setAngularVelocity(ToBtVector3(frozen.angular_velocity));
+	}
+
+	frozen_bodies.Clear();
+}
+
+void SelectiveReplay::add_body(btRigidBody * body)
+{
+	if (body_set.Contains(body))
+		return;
+	body_set.Insert(body);
+	bodies.Push(body);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+class btRigidBody;
+
+namespace Urho3D
+{
+	class Node;
+	class PhysicsWorld;
+}
+
+using namespace Urho3D;
+
+
+/*
+Limits a replay to the locally predicted bodies and the bodies they may interact with.
+
+The replayed set is the predicted nodes' bodies, the bodies in the same simulation islands,
+and the bodies near the path the predicted bodies can cover during the replay.
+The rest of the awake dynamic bodies are frozen in place while replaying, so they still act as obstacles,
+and get their exact state back afterwards. Sleeping bodies are not integrated, so they are left alone.
+Collecting only visits the bodies near the predicted ones. Freezing checks each collision object once, in constant time.
+The replay steps still run the broadphase and AABB updates of the whole world, only the integration and solving are limited.
+*/
+struct SelectiveReplay
+{
+	// Extra distance around the predicted bodies' replay path to include other bodies
+	float margin = 1.f;
+
+	// Add a locally predicted node, its rigid body is always replayed
+	void add_node(Node* node);
+	void remove_node(Node* node);
+	const Vector<WeakPtr<Node>>& get_nodes() const { return nodes; }
+
+	// Collect the bodies to replay for a replay of a given duration
+	void collect(PhysicsWorld* world, float duration);
+	// The collected bodies
+	const PODVector<btRigidBody*>& get_bodies() const { return bodies; }
+
+	// Freeze the rest of the awake dynamic bodies
+	void freeze(PhysicsWorld* world);
+	// Give the frozen bodies their state back
+	void unfreeze();
+
+protected:
+	Vector<WeakPtr<Node>> nodes;
+	PODVector<btRigidBody*> bodies;
+	// Same as bodies, for constant time membership tests
+	HashSet<btRigidBody*> body_set;
+
+	struct FrozenBody
+	{
+		btRigidBody* body;
+		int activation_state;
+		float deactivation_time;
+		Vector3 linear_velocity;
+		Vector3 angular_velocity;
+	};
+	PODVector<FrozenBody> frozen_bodies;
+
+	// Reusable query results
+	PODVector<int> island_tags;
+	PODVector<btRigidBody*> nearby_bodies;
+
+	void add_body(btRigidBody* body);
+};
@@ -1,24 +1,40 @@
 #include "CSP_Server.h"
+#include "CSP_Trace.h"
 
+#include <Urho3D/Container/Sort.h>
 #include <Urho3D/Core/Context.h>
-#include <Urho3D/Core/CoreEvents.h>
-#include <Urho3D/Engine/DebugHud.h>
+#include <Urho3D/Core/Timer.h>
 #include <Urho3D/IO/Log.h>
 #include <Urho3D/IO/MemoryBuffer.h>
-#include <Urho3D/Input/Controls.h>
 #include <Urho3D/Network/Network.h>
 #include <Urho3D/Network/NetworkEvents.h>
+#include <Urho3D/Physics/PhysicsEvents.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Physics/RigidBody.h>
 #include <Urho3D/Scene/Scene.h>
 #include <Urho3D/Scene/SceneEvents.h>
 
+// State header, snapshot ID and baseline snapshot ID
+static constexpr unsigned STATE_HEADER_SIZE = 4 + 4 + 4 + 4 + 1 + 1 + 4 + 4;
+// Snapshot format and node count
+static constexpr unsigned QUANTIZED_STATE_HEADER_SIZE = 1 + 5;
+
 CSP_Server::CSP_Server(Context * context) :
 	Component(context)
 {
 	// Receive update messages
 	SubscribeToEvent(E_NETWORKMESSAGE, URHO3D_HANDLER(CSP_Server, HandleNetworkMessage));
 
-	// Send update messages
-	SubscribeToEvent(E_RENDERUPDATE, URHO3D_HANDLER(CSP_Server, HandleRenderUpdate));
+	SubscribeToEvent(E_CLIENTDISCONNECTED, URHO3D_HANDLER(CSP_Server, HandleClientDisconnected));
+
+	// Apply inputs
+	SubscribeToEvent(E_PHYSICSPRESTEP, URHO3D_HANDLER(CSP_Server, HandlePhysicsPreStep));
+
+	// Send update messages, aligned with the physics ticks
+	SubscribeToEvent(E_PHYSICSPOSTSTEP, URHO3D_HANDLER(CSP_Server, HandlePhysicsPostStep));
+
+	transport = new NetworkTransport(context);
+	metrics = new MetricsRegistry();
 }
 
 void CSP_Server::RegisterObject(Context * context)
@@ -26,75 +42,291 @@ void CSP_Server::RegisterObject(Context * context)
 	context->RegisterFactory<CSP_Server>();
 }
 
-void CSP_Server::add_node(Node * node)
+CSP_Server::ClientState* CSP_Server::get_client(Object * connection)
+{
+	auto i = client_indices.Find(connection);
+	if (i == client_indices.End())
+		return nullptr;
+	return &clients[i->second_];
+}
+
+CSP_Server::ClientState& CSP_Server::get_or_create_client(Object * connection)
+{
+	bind_metrics();
+
+	auto i = client_indices.Find(connection);
+	if (i != client_indices.End())
+		return clients[i->second_];
+
+	client_indices[connection] = clients.Size();
+	clients.Push(ClientState());
+	auto& client = clients.Back();
+	client.connection = connection;
+	client.name = transport->get_name(connection);
+	bind_client_metrics(client);
+	return client;
+}
+
+void CSP_Server::bind_metrics()
+{
+	if (bound_metrics == metrics)
+		return;
+	bound_metrics = metrics;
+
+	snapshots_sent = metrics->counter("server.snapshots_sent");
+	snapshot_encode_ms = metrics->histogram("server.snapshot_encode_ms", { 0.1f, 0.25f, 0.5f, 1.f, 2.f, 4.f, 8.f, 16.f });
+	for (auto& client : clients)
+		bind_client_metrics(client);
+}
+
+void CSP_Server::bind_client_metrics(ClientState & client)
 {
+	client.input_depth = metrics->histogram("server.input_depth", { 0.f, 1.f, 2.f, 3.f, 4.f, 6.f, 8.f, 12.f, 16.f }, client.name);
+	client.late_inputs = metrics->counter("server.late_inputs", client.name);
+	client.dropped_inputs = metrics->counter("server.dropped_inputs", client.name);
+	client.snapshot_bytes = metrics->histogram("server.snapshot_bytes", { 64.f, 128.f, 256.f, 512.f, 1024.f, 1400.f, 4096.f, 16384.f }, client.name);
+}
+
+void CSP_Server::add_node(Node * node, float radius, float priority)
+{
+	if (priority != 1.f)
+		node_priorities[node->GetID()] = priority;
+
 	scene_snapshots[node->GetScene()].add_node(node);
+	scene_quantized_snapshots[node->GetScene()].add_node(node);
+	scene_interest_grids[node->GetScene()].add_node(node, radius);
+	if (node->GetScene() == GetScene())
+	{
+		lag_compensation.add_node(node);
+
+		// Get notified when the node moves
+		node->AddListener(this);
+		change_tracker.mark_changed(node->GetID(), tick + 1);
+	}
 }
 
-void CSP_Server::HandleNetworkMessage(StringHash eventType, VariantMap & eventData)
+void CSP_Server::set_error_threshold(Node * node, float threshold)
+{
+	if (threshold > 0.f)
+		node_error_thresholds[node->GetID()] = threshold;
+	else
+		node_error_thresholds.Erase(node->GetID());
+}
+
+void CSP_Server::OnMarkedDirty(Node * node)
 {
-	auto network = GetSubsystem<Network>();
+	// Recorded even while skip_unchanged is off, so switching it on doesn't trust epochs which missed changes.
+	// Changes until the end of a tick belong to it
+	change_tracker.mark_changed(node->GetID(), tick + 1);
 
+	// Watch the awake bodies for falling asleep, which changes their velocity but not their transform
+	auto body = node->GetComponent<RigidBody>();
+	if (body && body->IsActive())
+		change_tracker.mark_awake(node->GetID());
+}
+
+void CSP_Server::HandleNetworkMessage(StringHash eventType, VariantMap & eventData)
+{
 	using namespace NetworkMessage;
 	const auto message_id = eventData[P_MESSAGEID].GetInt();
 	auto connection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
 	MemoryBuffer message(eventData[P_DATA].GetBuffer());
 
-	if (network->IsServerRunning())
+	receive_message(connection, message_id, message);
+}
+
+void CSP_Server::receive_message(Object * connection, int message_id, MemoryBuffer & message)
+{
+	if (transport->is_server_running())
 	{
 		switch (message_id)
 		{
 		case MSG_CSP_INPUT:
 			URHO3D_LOGDEBUG("MSG_CSP_INPUT");
+			if (recorder)
+				recorder->record(tick, transport->get_name(connection), message_id, message.GetData(), message.GetSize());
 			read_input(connection, message);
 			break;
 		}
 	}
 }
 
-void CSP_Server::HandleRenderUpdate(StringHash eventType, VariantMap & eventData)
+void CSP_Server::HandleClientDisconnected(StringHash eventType, VariantMap & eventData)
+{
+	using namespace ClientDisconnected;
+	remove_client(static_cast<Connection*>(eventData[P_CONNECTION].GetPtr()));
+}
+
+void CSP_Server::remove_client(Object * connection)
+{
+	auto i = client_indices.Find(connection);
+	if (i == client_indices.End())
+		return;
+
+	if (bound_metrics)
+		bound_metrics->remove_connection(clients[i->second_].name);
+
+	// Move the last client into the removed client's place to keep the array dense
+	const auto index = i->second_;
+	client_indices.Erase(i);
+	if (index != clients.Size() - 1)
+	{
+		clients[index] = clients.Back();
+		client_indices[clients[index].connection] = index;
+	}
+	clients.Pop();
+}
+
+void CSP_Server::HandlePhysicsPreStep(StringHash eventType, VariantMap & eventData)
+{
+	using namespace PhysicsPreStep;
+
+	auto physicsWorld = static_cast<PhysicsWorld*>(eventData[P_WORLD].GetPtr());
+	if (physicsWorld->GetScene() != GetScene() ||
+		!transport->is_server_running())
+		return;
+
+	apply_client_inputs(eventData[P_TIMESTEP].GetFloat());
+}
+
+void CSP_Server::HandlePhysicsPostStep(StringHash eventType, VariantMap & eventData)
 {
-	auto network = GetSubsystem<Network>();
+	using namespace PhysicsPostStep;
 
-	auto timeStep = eventData[RenderUpdate::P_TIMESTEP].GetFloat();
+	auto physicsWorld = static_cast<PhysicsWorld*>(eventData[P_WORLD].GetPtr());
+	if (physicsWorld->GetScene() != GetScene() ||
+		!transport->is_server_running())
+		return;
 
-	// Check if periodic update should happen now
-	updateAcc_ += timeStep;
-	bool updateNow = updateAcc_ >= updateInterval_;
+	++tick;
+	lag_compensation.save(tick);
+	bind_metrics();
 
-	if (updateNow && network->IsServerRunning())
+	// Node only notifies the first change until its transform is read again, read the changed ones
+	auto changes = change_tracker.get_changes(tick);
+	if (changes)
 	{
-		updateAcc_ = fmodf(updateAcc_, updateInterval_);
+		for (auto node_id : *changes)
+		{
+			auto node = GetScene()->GetNode(node_id);
+			if (node)
+				node->GetWorldTransform();
+		}
+	}
+	change_tracker.update_awake(GetScene(), tick);
 
+	// The state right after a tick, the same tick the clients' last applied inputs were simulated in
+	if (tick % Max(snapshot_tick_divisor, 1u) == 0)
+	{
+		HiresTimer encode_timer;
 		prepare_state_snapshots();
 		send_state_updates();
+		const auto encode_time = encode_timer.GetUSec(false) / 1000000.f;
+		snapshot_encode_time += encode_time;
+		snapshot_encode_ms->record(encode_time * 1000.f);
+	}
+
+	transport->update(eventData[P_TIMESTEP].GetFloat());
+	metrics->update();
+}
+
+void CSP_Server::apply_client_inputs(float timeStep)
+{
+	if (!apply_client_input)
+		return;
+
+	bind_metrics();
+
+	auto scene = GetScene();
+	InputRecord input;
+
+	for (auto& client : clients)
+	{
+		if (transport->get_scene(client.connection) != scene)
+			continue;
+
+		// Repeats the last input if the client's input didn't arrive in time
+		const auto starvations = client.inputs.starvations;
+		const auto overflows = client.inputs.overflows;
+		client.input_depth->record(static_cast<float>(client.inputs.size()));
+		if (!client.inputs.pop(input))
+			continue;
+		client.late_inputs->add(client.inputs.starvations - starvations);
+		client.dropped_inputs->add(client.inputs.overflows - overflows);
+
+		TraceScope trace("apply_client_input");
+		trace.arg("tick", tick + 1);
+		trace.arg("input", input.id);
+
+		// The client sees about one more tick per input. Handle range looping correctly
+		client.view_tick = client.received_view_tick - (client.received_id - input.id);
+		client.view_fraction = client.received_view_fraction;
+
+		apply_client_input(input, timeStep, client.connection);
+		client.input_id = input.id;
 	}
 }
 
-void CSP_Server::read_input(Connection * connection, MemoryBuffer & message)
+void CSP_Server::read_input(Object * connection, MemoryBuffer & message)
 {
-	auto network = GetSubsystem<Network>();
+	TraceScope trace("read_input");
+	trace.arg("tick", tick);
 
-	if (!connection->IsClient())
+	if (!transport->is_client(connection))
 	{
-		URHO3D_LOGWARNING("Received unexpected Controls message from server");
+		URHO3D_LOGWARNING("Received unexpected input message from server");
 		return;
 	}
 
-	Controls newControls;
-	newControls.buttons_ = message.ReadUInt();
-	newControls.yaw_ = message.ReadFloat();
-	newControls.pitch_ = message.ReadFloat();
-	newControls.extraData_ = message.ReadVariantMap();
+	auto& client = get_or_create_client(connection);
+
+	// Newest snapshot the client has, handle range looping correctly
+	const auto snapshot_ack = message.ReadUInt();
+	if (client.snapshot_ack == 0 || int(snapshot_ack - client.snapshot_ack) > 0)
+	{
+		client.snapshot_ack = snapshot_ack;
+		commit_sent_states(client, snapshot_ack);
+	}
+
+	// Newest client timestamp to echo back, and what the client was seeing when it sampled the newest input
+	const auto client_time = message.ReadFloat();
+	const auto view_tick = message.ReadUInt();
+	const auto view_fraction = message.ReadUByte() / 256.f;
+	if (client_time > client.client_time)
+	{
+		client.client_time = client_time;
+		client.client_time_received = GetSubsystem<Time>()->GetElapsedTime();
+		client.received_view_tick = view_tick;
+		client.received_view_fraction = view_fraction;
+	}
 
-	if (client_inputs[connection].empty() ||
-		newControls.extraData_["id"].GetUInt() > client_inputs[connection].back().extraData_["id"].GetUInt()) {
-		client_inputs[connection].push(newControls);
+	// Newest input first, then older ones which may repeat inputs from previous messages
+	const auto count = message.ReadUByte();
+	if (count == 0)
+		return;
+	received_inputs.Resize(count);
+	received_inputs[0].read(message);
+	trace.arg("input", received_inputs[0].id);
+	for (unsigned i = 1; i < count; ++i)
+	{
+		received_inputs[i].read_delta(message, received_inputs[i - 1]);
+		received_inputs[i].id = received_inputs[i - 1].id - 1;
 	}
 
-	// testing applying input in PreStep
-	//client_input_IDs[connection] = newControls.extraData_["id"].GetUInt();
-	//apply_client_input(newControls, timestep, connection);
+	client.inputs.on_message(received_inputs[0].id, GetSubsystem<Time>()->GetElapsedTime(), timestep);
+
+	// Buffer the inputs that weren't received yet, oldest first. Handle range looping correctly
+	const auto overflows = client.inputs.overflows;
+	for (unsigned i = count; i-- > 0;)
+	{
+		auto& new_input = received_inputs[i];
+		if (client.received_id == 0 || int(new_input.id - client.received_id) > 0)
+		{
+			client.inputs.push(new_input);
+			client.received_id = new_input.id;
+		}
+	}
+	client.dropped_inputs->add(client.inputs.overflows - overflows);
 
 	// No access, and currently no use
 	//// Client may or may not send observer position & rotation for interest management
@@ -106,54 +338,463 @@ void CSP_Server::read_input(Connection * connection, MemoryBuffer & message)
 
 void CSP_Server::prepare_state_snapshots()
 {
-	auto network = GetSubsystem<Network>();
-	auto client_connections = network->GetClientConnections();
+	TraceScope trace("prepare_state_snapshots");
+	trace.arg("tick", tick);
+
+	transport->get_clients(client_connections);
 
 	// Collect all networked scenes
 	network_scenes.Clear();
 	for (auto i = client_connections.Begin(); i != client_connections.End(); ++i)
 	{
-		Scene* scene = (*i)->GetScene();
+		Scene* scene = transport->get_scene(*i);
 		if (scene)
 			network_scenes.Insert(scene);
 	}
 
+	// 0 is reserved for no baseline
+	if (++snapshot_id == 0)
+		++snapshot_id;
+
 	// Prepare all networked scenes
 	for (auto i = network_scenes.Begin(); i != network_scenes.End(); ++i)
 	{
 		auto scene = (*i);
 
-		auto& state_message = scene_states[scene];
-		state_message.Clear();
+		// Per-connection states are written in send_state_update()
+		if (has_connection_states())
+		{
+			auto& grid = scene_interest_grids[scene];
+			grid.cell_size = interest_cell_size;
+			grid.update();
+			continue;
+		}
 
-		// Write placeholder last input ID, which will be set per connection before sending
-		state_message.WriteUInt(0);
+		auto& state = scene_states[scene];
+		state.Clear();
 
 		// write state snapshot
-		auto& snapshot = scene_snapshots[scene];
-		snapshot.write_state(state_message, scene);
+		if (quantize_snapshots && state_schema)
+		{
+			scene_quantized_snapshots[scene].get_nodes(chunk_nodes);
+			write_quantized_state(state, chunk_nodes);
+		}
+		else if (quantize_snapshots)
+		{
+			state.WriteUByte(SNAPSHOT_QUANTIZED);
+			scene_quantized_snapshots[scene].write_state(state, scene, quantization);
+		}
+		else
+		{
+			state.WriteUByte(SNAPSHOT_FULL);
+			scene_snapshots[scene].write_state(state, scene);
+		}
+	}
+}
 
-		GetSubsystem<DebugHud>()->SetAppStats("snapshots_sent: ", ++snapshots_sent);
+void CSP_Server::write_quantized_state(VectorBuffer & state, const PODVector<Node*>& nodes)
+{
+	if (state_schema)
+	{
+		state.WriteUByte(SNAPSHOT_SCHEMA);
+		state_schema->write_state(state, nodes, quantization);
+	}
+	else
+	{
+		state.WriteUByte(SNAPSHOT_QUANTIZED);
+		QuantizedSnapshot::write_state(state, nodes, quantization);
 	}
 }
 
+unsigned CSP_Server::get_max_node_bits() const
+{
+	return state_schema ?
+		state_schema->get_max_node_bits(quantization) :
+		QuantizedSnapshot::get_max_node_bits(quantization);
+}
+
 void CSP_Server::send_state_updates()
 {
-	auto network = GetSubsystem<Network>();
-	auto client_connections = network->GetClientConnections();
+	TraceScope trace("send_state_updates");
+	trace.arg("tick", tick);
+	trace.arg("snapshot", snapshot_id);
+
+	transport->get_clients(client_connections);
 
 	for (auto i = client_connections.Begin(); i != client_connections.End(); ++i)
 		send_state_update((*i));
 }
 
-void CSP_Server::send_state_update(Connection * connection)
+void CSP_Server::write_state_header(const ClientState & client, VectorBuffer & message)
 {
 	// Set the last input ID per connection
-	unsigned int last_id = client_input_IDs[connection];
+	message.WriteUInt(client.input_id);
+	message.WriteUInt(tick);
+
+	// Echo the client's newest timestamp, the time it spent here doesn't count as round trip time
+	const auto hold_time = client.client_time_received > 0.f ?
+		GetSubsystem<Time>()->GetElapsedTime() - client.client_time_received : 0.f;
+	message.WriteFloat(client.client_time);
+	message.WriteFloat(hold_time);
+
+	// The client adjusts its simulation rate to keep its inputs buffered at the target depth
+	message.WriteUByte(Min(client.inputs.size(), 255u));
+	message.WriteUByte(Min(client.inputs.get_target_depth(), 255u));
+}
+
+void CSP_Server::send_state_update(Object * connection)
+{
+	auto scene = transport->get_scene(connection);
+	if (!scene)
+		return;
 
-	auto& state = scene_states[connection->GetScene()];
-	state.Seek(0);
-	state.WriteUInt(last_id);
+	auto& client = get_or_create_client(connection);
+	auto& history = client.snapshot_history;
 
-	connection->SendMessage(MSG_CSP_STATE, false, false, state);
+	TraceScope trace("send_state_update");
+	trace.arg("snapshot", snapshot_id);
+	trace.arg("input", client.input_id);
+
+	if (has_connection_states())
+		write_relevant_state(client, scene, connection_state);
+	const auto& state = has_connection_states() ?
+		connection_state.GetBuffer() :
+		scene_states[scene].GetBuffer();
+
+	state_message.Clear();
+	write_state_header(client, state_message);
+	state_message.WriteUInt(snapshot_id);
+
+	// Delta compress against the newest snapshot the client acknowledged, if it's still in the history
+	const auto baseline_id = client.snapshot_ack;
+	auto baseline = history.get(baseline_id);
+	if (baseline)
+	{
+		state_message.WriteUInt(baseline_id);
+		write_delta(state_message, *baseline, state);
+	}
+
+	// A delta can end up bigger than the state itself, don't let it break the bandwidth budget
+	if (!baseline || state_message.GetSize() > STATE_HEADER_SIZE + state.Size())
+	{
+		state_message.Resize(STATE_HEADER_SIZE - 4);
+		state_message.WriteUInt(0);
+		state_message.Write(state.Buffer(), state.Size());
+	}
+
+	// Chunks are sent as they are, and not kept as delta baselines.
+	// A lost chunk would leave nodes behind, so they don't move the client's synced tick or dead reckoning states either.
+	if (max_message_size > 0 && has_connection_states() && state_message.GetSize() > max_message_size)
+	{
+		client.synced_ticks[snapshot_id % SnapshotHistory::SIZE] = client.next_synced;
+		client.pending_states[snapshot_id % SnapshotHistory::SIZE].snapshot_id = 0;
+		send_state_chunks(client);
+		snapshots_sent->add();
+		return;
+	}
+
+	// Every node which changed since the synced tick was sent, unless some didn't fit the bandwidth budget.
+	// Nodes with an error threshold don't count, they're candidates in every snapshot and have their own baseline.
+	if (has_connection_states())
+	{
+		if (client.deferred_nodes == 0)
+			client.next_synced = { snapshot_id, tick, true };
+		client.synced_ticks[snapshot_id % SnapshotHistory::SIZE] = client.next_synced;
+	}
+
+	history.add(snapshot_id, state);
+
+	client.snapshot_bytes->record(static_cast<float>(state_message.GetSize()));
+	if (recorder)
+		recorder->record(tick, client.name, MSG_CSP_STATE, state_message.GetData(), state_message.GetSize());
+	transport->send(connection, MSG_CSP_STATE, false, state_message);
+	snapshots_sent->add();
+}
+
+void CSP_Server::write_relevant_state(ClientState & client, Scene * scene, VectorBuffer & state)
+{
+	// Only the server's scene tracks changes
+	ID synced_tick = 0;
+	const auto synced = skip_unchanged && scene == GetScene() && get_synced_tick(client, synced_tick);
+	client.next_synced = { snapshot_id, synced_tick, synced };
+
+	auto& grid = scene_interest_grids[scene];
+	auto& nodes = client.relevant_nodes;
+	nodes.Clear();
+	changed_ids.Clear();
+	if (interest_management)
+	{
+		grid.query(transport->get_position(client.connection), interest_radius, nodes);
+		if (skip_unchanged)
+			select_changed(client, synced, synced_tick, nodes);
+	}
+	else if (synced && change_tracker.get_changed_since(synced_tick, tick, changed_ids))
+	{
+		// Only visit the nodes which changed
+		for (auto node_id : changed_ids)
+		{
+			auto node = scene->GetNode(node_id);
+			if (node)
+				nodes.Push(node);
+		}
+
+		// select_by_error decides about the nodes with an error threshold, whether they changed or not
+		for (auto it = node_error_thresholds.Begin(); it != node_error_thresholds.End(); ++it)
+		{
+			if (change_tracker.is_changed_since(it->first_, synced_tick))
+				continue;
+			auto node = scene->GetNode(it->first_);
+			if (node)
+				nodes.Push(node);
+		}
+	}
+	else
+		nodes = grid.get_nodes();
+
+	client.extrapolated_nodes = 0;
+	if (!node_error_thresholds.Empty())
+		select_by_error(client, nodes);
+
+	client.deferred_nodes = 0;
+	if (bandwidth_budget > 0)
+		select_by_priority(client, nodes);
+
+	if (!node_error_thresholds.Empty())
+		save_sent_states(client, nodes);
+
+	// Ascending IDs for compact IDs
+	Sort(nodes.Begin(), nodes.End(), [](Node* a, Node* b) { return a->GetID() < b->GetID(); });
+
+	state.Clear();
+	write_quantized_state(state, nodes);
+}
+
+void CSP_Server::send_state_chunks(ClientState & client)
+{
+	const auto& nodes = client.relevant_nodes;
+	if (nodes.Empty())
+		return;
+
+	// Whole nodes per chunk, by the largest size a node can take
+	const auto header_size = SNAPSHOT_CHUNK_HEADER_SIZE + QUANTIZED_STATE_HEADER_SIZE;
+	const auto payload_bits = max_message_size > header_size ? (max_message_size - header_size) * 8 : 0;
+	auto nodes_per_chunk = Max(payload_bits / get_max_node_bits(), 1u);
+	if (nodes.Size() > nodes_per_chunk * MAX_SNAPSHOT_CHUNKS)
+	{
+		URHO3D_LOGWARNING("Snapshot needs more than " + String(MAX_SNAPSHOT_CHUNKS) + " chunks, chunks will exceed max_message_size");
+		nodes_per_chunk = (nodes.Size() + MAX_SNAPSHOT_CHUNKS - 1) / MAX_SNAPSHOT_CHUNKS;
+	}
+	const auto chunk_count = (nodes.Size() + nodes_per_chunk - 1) / nodes_per_chunk;
+
+	for (unsigned chunk = 0; chunk < chunk_count; ++chunk)
+	{
+		// Nodes are in ascending ID order, so each chunk covers an ID range
+		const auto first = chunk * nodes_per_chunk;
+		const auto end = Min(first + nodes_per_chunk, nodes.Size());
+		chunk_nodes.Clear();
+		for (auto i = first; i < end; ++i)
+			chunk_nodes.Push(nodes[i]);
+
+		state_message.Clear();
+		write_state_header(client, state_message);
+		state_message.WriteUInt(snapshot_id);
+		state_message.WriteUByte(chunk);
+		state_message.WriteUByte(chunk_count);
+		state_message.WriteUInt(chunk_nodes.Front()->GetID());
+		state_message.WriteUInt(chunk_nodes.Back()->GetID());
+		write_quantized_state(state_message, chunk_nodes);
+
+		client.snapshot_bytes->record(static_cast<float>(state_message.GetSize()));
+		if (recorder)
+			recorder->record(tick, client.name, MSG_CSP_STATE_CHUNK, state_message.GetData(), state_message.GetSize());
+		transport->send(client.connection, MSG_CSP_STATE_CHUNK, false, state_message);
+	}
+}
+
+void CSP_Server::select_changed(ClientState & client, bool synced, ID synced_tick, PODVector<Node*>& nodes)
+{
+	unsigned kept = 0;
+	for (auto node : nodes)
+	{
+		// A node entering the interest range is new to the client even if it didn't change
+		auto& relevance = client.relevance[node->GetID()];
+		if (relevance.snapshot_id == 0)
+			relevance.since = tick;
+		relevance.snapshot_id = snapshot_id;
+
+		// Nodes with an error threshold are left to select_by_error. Handle range looping correctly
+		if (!synced || int(relevance.since - synced_tick) > 0 || change_tracker.is_changed_since(node->GetID(), synced_tick) ||
+			node_error_thresholds.Contains(node->GetID()))
+			nodes[kept++] = node;
+	}
+	nodes.Resize(kept);
+
+	// Forget the nodes which aren't relevant anymore
+	for (auto it = client.relevance.Begin(); it != client.relevance.End();)
+	{
+		if (it->second_.snapshot_id != snapshot_id)
+			it = client.relevance.Erase(it);
+		else
+			++it;
+	}
+}
+
+void CSP_Server::select_by_error(ClientState & client, PODVector<Node*>& nodes)
+{
+	// The client's interpolation buffer stops extrapolating after max_extrapolation,
+	// send a fresh state at least a snapshot interval before that
+	const auto extrapolation_ticks = timestep > 0.f ? static_cast<int>(max_extrapolation / timestep) : 0;
+	const auto refresh = Min(static_cast<int>(dead_reckoning_refresh), extrapolation_ticks - static_cast<int>(Max(snapshot_tick_divisor, 1u)));
+
+	unsigned kept = 0;
+	for (auto node : nodes)
+	{
+		auto threshold_it = node_error_thresholds.Find(node->GetID());
+		if (threshold_it == node_error_thresholds.End())
+		{
+			nodes[kept++] = node;
+			continue;
+		}
+
+		auto& sent = client.sent_states[node->GetID()];
+		sent.snapshot_id = snapshot_id;
+
+		// What the client's interpolation buffer extrapolates from the last acknowledged state. Handle range looping correctly
+		const auto elapsed_ticks = int(tick - sent.tick);
+		if (sent.sent && elapsed_ticks < refresh)
+		{
+			const auto extrapolated = sent.position + sent.velocity * (elapsed_ticks * timestep);
+			const auto threshold = threshold_it->second_;
+			if ((node->GetWorldPosition() - extrapolated).LengthSquared() <= threshold * threshold)
+			{
+				++client.extrapolated_nodes;
+				continue;
+			}
+		}
+
+		nodes[kept++] = node;
+	}
+	nodes.Resize(kept);
+
+	// Forget the nodes which aren't relevant anymore
+	for (auto it = client.sent_states.Begin(); it != client.sent_states.End();)
+	{
+		if (it->second_.snapshot_id != snapshot_id)
+			it = client.sent_states.Erase(it);
+		else
+			++it;
+	}
+}
+
+void CSP_Server::save_sent_states(ClientState & client, const PODVector<Node*>& nodes)
+{
+	// The client may not get this snapshot, so it only becomes the extrapolation baseline once acknowledged.
+	// Until then select_by_error keeps comparing against the previous baseline, and keeps sending nodes off from it.
+	auto& pending = client.pending_states[snapshot_id % SnapshotHistory::SIZE];
+	pending.snapshot_id = snapshot_id;
+	pending.states.Clear();
+
+	for (auto node : nodes)
+	{
+		if (!client.sent_states.Contains(node->GetID()))
+			continue;
+
+		auto body = node->GetComponent<RigidBody>();
+		ClientState::PendingState state;
+		state.node_id = node->GetID();
+		state.tick = tick;
+		state.position = node->GetWorldPosition();
+		state.velocity = body ? body->GetLinearVelocity() : Vector3::ZERO;
+		pending.states.Push(state);
+	}
+}
+
+void CSP_Server::commit_sent_states(ClientState & client, ID snapshot_ack)
+{
+	auto& pending = client.pending_states[snapshot_ack % SnapshotHistory::SIZE];
+	if (pending.snapshot_id != snapshot_ack)
+		return;
+
+	for (auto& state : pending.states)
+	{
+		// Nodes which stopped being relevant start over
+		auto it = client.sent_states.Find(state.node_id);
+		if (it == client.sent_states.End())
+			continue;
+
+		// Handle range looping correctly
+		auto& sent = it->second_;
+		if (sent.sent && int(state.tick - sent.tick) <= 0)
+			continue;
+
+		sent.tick = state.tick;
+		sent.position = state.position;
+		sent.velocity = state.velocity;
+		sent.sent = true;
+	}
+
+	pending.snapshot_id = 0;
+	pending.states.Clear();
+}
+
+bool CSP_Server::get_synced_tick(const ClientState & client, ID & synced_tick) const
+{
+	const auto& synced = client.synced_ticks[client.snapshot_ack % SnapshotHistory::SIZE];
+	if (client.snapshot_ack == 0 || synced.snapshot_id != client.snapshot_ack || !synced.synced)
+		return false;
+
+	synced_tick = synced.tick;
+	return true;
+}
+
+void CSP_Server::select_by_priority(ClientState & client, PODVector<Node*>& nodes)
+{
+	const auto observer = transport->get_position(client.connection);
+
+	// Grow the relevant nodes' priorities by the time since the last update
+	prioritized_nodes.Clear();
+	for (auto node : nodes)
+	{
+		auto weight = 1.f;
+		auto weight_it = node_priorities.Find(node->GetID());
+		if (weight_it != node_priorities.End())
+			weight = weight_it->second_;
+
+		const auto distance = (node->GetWorldPosition() - observer).Length();
+		auto body = node->GetComponent<RigidBody>();
+		const auto speed = body ? body->GetLinearVelocity().Length() : 0.f;
+
+		auto& accumulator = client.priorities[node->GetID()];
+		accumulator.priority += weight * timestep * snapshot_tick_divisor *
+			(1.f + speed * priority_velocity_scale) / (1.f + distance * priority_distance_scale);
+		accumulator.snapshot_id = snapshot_id;
+
+		prioritized_nodes.Push({ node, accumulator.priority });
+	}
+
+	// Forget the nodes which aren't relevant anymore
+	for (auto it = client.priorities.Begin(); it != client.priorities.End();)
+	{
+		if (it->second_.snapshot_id != snapshot_id)
+			it = client.priorities.Erase(it);
+		else
+			++it;
+	}
+
+	Sort(prioritized_nodes.Begin(), prioritized_nodes.End(),
+		[](const PrioritizedNode& a, const PrioritizedNode& b) { return a.priority > b.priority; });
+
+	// Highest priorities first, by the largest size a node can take
+	const auto header_size = STATE_HEADER_SIZE + QUANTIZED_STATE_HEADER_SIZE;
+	const auto budget_bits = bandwidth_budget > header_size ? (bandwidth_budget - header_size) * 8 : 0;
+	const auto node_bits = get_max_node_bits();
+	const auto count = Min(budget_bits / node_bits, prioritized_nodes.Size());
+
+	nodes.Clear();
+	for (unsigned i = 0; i < count; ++i)
+	{
+		nodes.Push(prioritized_nodes[i].node);
+		client.priorities[prioritized_nodes[i].node->GetID()].priority = 0;
+	}
+	client.deferred_nodes = prioritized_nodes.Size() - count;
 }
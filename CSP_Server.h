@@ -1,17 +1,26 @@
 #pragma once
 
-#include "CSP_Server.h"
+#include "CSP_ChangeTracker.h"
+#include "CSP_Delta.h"
+#include "CSP_Input.h"
+#include "CSP_InterestGrid.h"
+#include "CSP_JitterBuffer.h"
+#include "CSP_LagCompensation.h"
+#include "CSP_Metrics.h"
 #include "CSP_messages.h"
+#include "CSP_QuantizedSnapshot.h"
+#include "CSP_Recording.h"
+#include "CSP_Schema.h"
+#include "CSP_SnapshotChunks.h"
+#include "CSP_Transport.h"
 #include "StateSnapshot.h"
 #include <Urho3D/Scene/Component.h>
-#include <queue>
-#include <vector>
+#include <functional>
+#include <memory>
 
 namespace Urho3D
 {
 	class Context;
-	class Controls;
-	class Connection;
 	class MemoryBuffer;
 }
 
@@ -21,10 +30,15 @@ using namespace Urho3D;
 /*
 Client side prediction server.
 
-- receive inputs from clients
+- receive inputs from clients into adaptive jitter buffers
+- apply one input of each client per physics tick
 - keep track of each client's last input ID
 - sends last used input ID
-- sends state snapshot
+- sends state snapshot, delta compressed against the last snapshot the client acknowledged
+- optionally only sends each client the nodes near its observer position
+- splits snapshots too big for a datagram into independently decodable chunks
+- optionally skips the nodes that didn't change since the snapshot the client acknowledged
+- optionally skips the nodes the client can extrapolate closely enough from their last sent state
 */
 struct CSP_Server : Component
 {
@@ -40,15 +54,199 @@ struct CSP_Server : Component
 
 	// Fixed timestep length
 	float timestep = 0;
+	// Snapshots are sent every this many physics ticks, right after the tick
+	unsigned snapshot_tick_divisor = 2;
 
+	// Physics ticks simulated since the server started
+	ID get_tick() const { return tick; }
 
-	// Client input ID map
-	HashMap<Connection*, ID> client_input_IDs;
-	HashMap<Connection*, std::queue<Controls>> client_inputs;//TODO if using queue, use a getter
+	// Send compact quantized snapshots of transforms and velocities instead of StateSnapshot
+	bool quantize_snapshots = false;
+	// Quantized snapshot precision, must match the client's
+	QuantizationSettings quantization;
+	// Replicated fields of the quantized snapshots instead of transforms and velocities, must match the client's.
+	// For example std::make_shared<StateSchema<WorldPositionField<>, WorldRotationField<>>>().
+	std::shared_ptr<const StateSerializer> state_schema;
 
 
-	// Add a node to the client side prediction
-	void add_node(Node* node);
+	// Only send each client the nodes near its observer position, set with Connection::SetPosition on the client.
+	// Requires quantize_snapshots, StateSnapshot always carries the whole scene.
+	bool interest_management = false;
+	// Distance from the observer position within which nodes are sent
+	float interest_radius = 50.f;
+	// Interest grid cell size
+	float interest_cell_size = 25.f;
+
+	// Maximum state message size per connection and update in bytes, 0 for no limit. Requires quantize_snapshots.
+	// Nodes that don't fit wait for a later update, the ones waiting the longest and mattering the most go first.
+	unsigned bandwidth_budget = 0;
+	// State messages bigger than this many bytes are split into chunks of whole nodes, 0 to never split.
+	// Requires quantize_snapshots. Keep it under the path MTU to avoid IP fragmentation.
+	unsigned max_message_size = 0;
+
+	// How fast a node's priority falls off with its distance to the observer, per world unit
+	float priority_distance_scale = 0.1f;
+	// How much a node's priority grows with its speed, per world unit per second
+	float priority_velocity_scale = 0.1f;
+
+	// Only send the nodes which changed since the snapshot the client acknowledged, so sleeping and idle nodes cost nothing.
+	// Requires quantize_snapshots. The client keeps the last received state of the nodes left out.
+	bool skip_unchanged = false;
+
+	// Nodes given an error threshold with set_error_threshold() are sent at least every this many ticks
+	unsigned dead_reckoning_refresh = 15;
+	// Longest time the clients extrapolate an interpolated node, should match their interpolation.max_extrapolation.
+	// The refresh is shortened so the next state arrives before the client stops extrapolating.
+	float max_extrapolation = 0.25f;
+
+
+	// Transforms and bounds of the CSP nodes for the past ticks, for validating the clients' hits.
+	// Saved after each tick once given a capacity, for example lag_compensation.set_capacity(64, 256).
+	LagCompensation lag_compensation;
+
+
+	// Applies a client's input for a physics tick. The connection is a Connection with the default transport.
+	std::function<void(const InputRecord& input, float timestep, Object* connection)> apply_client_input;
+
+	// Where the messages go, Urho's Network by default
+	SharedPtr<CSP_Transport> transport;
+	// Handle a message received from a client through the transport
+	void receive_message(Object* connection, int message_id, MemoryBuffer& message);
+	// Forget a disconnected client's state
+	void remove_client(Object* connection);
+
+	// Seconds spent preparing and sending state snapshots, for profiling
+	float snapshot_encode_time = 0;
+
+	// Counters, gauges and histograms of the server and of each connection, can be shared with other servers and clients
+	SharedPtr<MetricsRegistry> metrics;
+	// Records the received input messages and the sent state messages when set and open
+	SharedPtr<Recorder> recorder;
+
+
+	// Per-client state
+	struct ClientState
+	{
+		Object* connection = nullptr;
+		// Name of the connection in the metrics
+		String name;
+
+		// Last applied input ID
+		ID input_id = 0;
+		// Newest received input ID
+		ID received_id = 0;
+		// Server tick and fraction of a tick the client was seeing when it sampled the newest received input, interpolation delay included
+		ID received_view_tick = 0;
+		float received_view_fraction = 0;
+		// Server tick and fraction the client was seeing when it sampled the last applied input, to query lag_compensation with
+		ID view_tick = 0;
+		float view_fraction = 0;
+		// Received inputs, also exposes the client's buffer depth and starvation/overflow counters
+		JitterBuffer inputs;
+
+		// Client time the newest input message was sent, and server time it arrived, echoed for the client's clock sync
+		float client_time = 0;
+		float client_time_received = 0;
+
+		// Last snapshot ID acknowledged by the client
+		ID snapshot_ack = 0;
+		// Snapshots sent to the client, used as delta baselines
+		SnapshotHistory snapshot_history;
+
+		// Nodes sent in the last snapshot when using interest management or a bandwidth budget
+		PODVector<Node*> relevant_nodes;
+		// Relevant nodes left out of the last snapshot by the bandwidth budget
+		unsigned deferred_nodes = 0;
+
+		// Priority accumulated since each relevant node was last sent, by node ID
+		struct PriorityAccumulator
+		{
+			float priority = 0;
+			// Last snapshot the node was relevant in
+			ID snapshot_id = 0;
+		};
+		HashMap<unsigned, PriorityAccumulator> priorities;
+
+		// Tick up to which a sent snapshot brings all the client's nodes, once it's acknowledged, for skip_unchanged
+		struct SyncedTick
+		{
+			SyncedTick() = default;
+			SyncedTick(ID snapshot_id, ID tick, bool synced) : snapshot_id(snapshot_id), tick(tick), synced(synced) {}
+
+			ID snapshot_id = 0;
+			ID tick = 0;
+			bool synced = false;
+		};
+		// By snapshot ID % SnapshotHistory::SIZE
+		SyncedTick synced_ticks[SnapshotHistory::SIZE];
+		// Synced tick of the snapshot being sent
+		SyncedTick next_synced;
+
+		// Tick each node entered the client's interest range in, by node ID, for skip_unchanged with interest management
+		struct Relevance
+		{
+			ID since = 0;
+			// Last snapshot the node was relevant in
+			ID snapshot_id = 0;
+		};
+		HashMap<unsigned, Relevance> relevance;
+
+		// Last state of each node with an error threshold in a snapshot the client acknowledged,
+		// which the client extrapolates from, by node ID
+		struct SentState
+		{
+			ID tick = 0;
+			Vector3 position;
+			Vector3 velocity;
+			bool sent = false;
+			// Last snapshot the node was relevant in
+			ID snapshot_id = 0;
+		};
+		HashMap<unsigned, SentState> sent_states;
+		// States of the nodes with an error threshold sent in a snapshot, moved to sent_states when the client acknowledges it
+		struct PendingState
+		{
+			unsigned node_id;
+			ID tick;
+			Vector3 position;
+			Vector3 velocity;
+		};
+		struct PendingStates
+		{
+			ID snapshot_id = 0;
+			PODVector<PendingState> states;
+		};
+		// By snapshot ID % SnapshotHistory::SIZE
+		PendingStates pending_states[SnapshotHistory::SIZE];
+		// Relevant nodes left to the client's extrapolation in the last snapshot
+		unsigned extrapolated_nodes = 0;
+
+		// Buffered inputs when applying one, inputs repeated because the next one was late, and inputs dropped to catch up
+		MetricHistogram* input_depth = nullptr;
+		MetricCounter* late_inputs = nullptr;
+		MetricCounter* dropped_inputs = nullptr;
+		// Size of the state messages and chunks sent
+		MetricHistogram* snapshot_bytes = nullptr;
+	};
+
+	// Get a client's state, nullptr if it didn't send any input yet.
+	// The states are kept in a dense array, so the pointer is only valid until a client is added or removed:
+	// look it up again instead of keeping it, for example once per apply_client_input call.
+	ClientState* get_client(Object* connection);
+	// All the clients' states, also reordered when a client is added or removed
+	const Vector<ClientState>& get_clients() const { return clients; }
+
+
+	// Add a node to the client side prediction.
+	// With interest management the node is sent to observers within interest_radius + radius.
+	// With a bandwidth budget its priority grows priority times faster, to weight node types.
+	void add_node(Node* node, float radius = 0.f, float priority = 1.f);
+
+	// Only send a node when the client's linear extrapolation from the last acknowledged position and velocity
+	// is off by more than a distance, or dead_reckoning_refresh ticks passed. 0 to always send it. Requires quantize_snapshots.
+	// Only for nodes every client interpolates with add_interpolated_node(), like projectiles and vehicles:
+	// that's the only place the client extrapolates linearly, other nodes run the client's physics between states.
+	void set_error_threshold(Node* node, float threshold);
 
 
 protected:
@@ -58,36 +256,122 @@ protected:
 	// State snapshot of each scene
 	HashMap<Scene*, VectorBuffer> scene_states;
 	HashMap<Scene*, StateSnapshot> scene_snapshots;
+	HashMap<Scene*, QuantizedSnapshot> scene_quantized_snapshots;
+	// Networked nodes of each scene by position, for interest management and prioritization
+	HashMap<Scene*, InterestGrid> scene_interest_grids;
+	// Priority weight of the nodes not weighted 1, by node ID
+	HashMap<unsigned, float> node_priorities;
+	// Dead reckoning error threshold of the nodes which have one, by node ID
+	HashMap<unsigned, float> node_error_thresholds;
+	// Change epochs of the networked nodes in the server's scene, for skip_unchanged. Always kept up to date.
+	ChangeTracker change_tracker;
 
-	// for debugging
-	unsigned snapshots_sent = 0;
+	// Current physics tick
+	ID tick = 0;
+	// Current snapshot ID, 0 is reserved for no baseline
+	ID snapshot_id = 0;
+	// Reusable per-connection state message
+	VectorBuffer state_message;
+	// Reusable per-connection state when using interest management or a bandwidth budget
+	VectorBuffer connection_state;
+
+	struct PrioritizedNode
+	{
+		Node* node;
+		float priority;
+	};
+	// Reusable buffer of the nodes sorted by priority
+	PODVector<PrioritizedNode> prioritized_nodes;
+	// Reusable buffer of a chunk's nodes, or a scene's nodes
+	PODVector<Node*> chunk_nodes;
+	// Reusable buffer of the changed node IDs
+	PODVector<unsigned> changed_ids;
+	// Reusable buffer of the inputs read from a message
+	PODVector<InputRecord> received_inputs;
+
+	// Clients in a dense array so per tick passes don't hash, indexed by client_indices
+	Vector<ClientState> clients;
+	HashMap<Object*, unsigned> client_indices;
+	// Reusable buffer of the transport's clients
+	PODVector<Object*> client_connections;
+
+	// Registry the metrics below and the clients' ones were created in, kept alive while they're used
+	SharedPtr<MetricsRegistry> bound_metrics;
+	// State snapshots sent to the clients, a chunked one counts once
+	MetricCounter* snapshots_sent = nullptr;
+	MetricHistogram* snapshot_encode_ms = nullptr;
 
 	// Handle custom network messages
 	void HandleNetworkMessage(StringHash eventType, VariantMap& eventData);
-	// Send state snapshots
-	void HandleRenderUpdate(StringHash eventType, VariantMap& eventData);
+	// Forget the client's state
+	void HandleClientDisconnected(StringHash eventType, VariantMap& eventData);
+	// Apply the clients' inputs
+	void HandlePhysicsPreStep(StringHash eventType, VariantMap& eventData);
+	// Count ticks and send state snapshots
+	void HandlePhysicsPostStep(StringHash eventType, VariantMap& eventData);
+	// Stamp a networked node as changed in the current tick
+	void OnMarkedDirty(Node* node) override;
 
-	// Read input sent from the client and apply it
-	void read_input(Connection* connection, MemoryBuffer& message);
+	// Get a client's state, creating it if needed
+	ClientState& get_or_create_client(Object* connection);
+	// Create the metrics in the current registry, if it was replaced
+	void bind_metrics();
+	void bind_client_metrics(ClientState& client);
+	// Apply the next buffered input of each client
+	void apply_client_inputs(float timeStep);
+
+	// Read input sent from the client and buffer it
+	void read_input(Object* connection, MemoryBuffer& message);
+
+	/*
+	input serialization structure:
+	- last snapshot ID received by the client
+	- client time when sent
+	- server tick the client is seeing
+	- input count
+	- newest input
+	- older inputs, each delta coded against the following one
+	*/
 
 	/*
 	serialization structure:
-	- Last input ID
-	- state snapshot
+	- state header:
+		- Last input ID
+		- server tick the state is from
+		- client time of the newest input message, and how long the server held it
+		- client's input buffer size and target depth
+	- snapshot ID
+	- baseline snapshot ID, 0 if the state isn't delta compressed
+	- state snapshot, or its delta against the baseline
 	*/
+	// Write the per-connection header of state messages and chunks
+	void write_state_header(const ClientState& client, VectorBuffer& message);
 	// Prepare state snapshot for each networked scene
 	void prepare_state_snapshots();
 	// For each connection send the last received input ID and scene state snapshot
 	void send_state_updates();
 	// Send a state update to a given connection
-	void send_state_update(Connection* connection);
-
-
-private:
-	// Update time interval
-	// Update time accumulator
-	float updateAcc_ = 0;
-public:
-	//TODO same as timestep?
-	float updateInterval_ = 1.f / 30.f;	// default to 30 FPS
+	void send_state_update(Object* connection);
+	// Write a quantized state of nodes in ascending ID order, in the schema's format if there is one
+	void write_quantized_state(VectorBuffer& state, const PODVector<Node*>& nodes);
+	// Upper bound of a node's size in bits in the quantized state
+	unsigned get_max_node_bits() const;
+	// Whether the nodes sent differ per connection
+	bool has_connection_states() const { return quantize_snapshots && (interest_management || bandwidth_budget > 0 || max_message_size > 0 || skip_unchanged || !node_error_thresholds.Empty()); }
+	// Write the state of the nodes relevant to a client
+	void write_relevant_state(ClientState& client, Scene* scene, VectorBuffer& state);
+	// Send a client's relevant nodes in chunks of at most max_message_size
+	void send_state_chunks(ClientState& client);
+	// Keep the relevant nodes with the highest accumulated priority that fit the bandwidth budget
+	void select_by_priority(ClientState& client, PODVector<Node*>& nodes);
+	// Keep the relevant nodes which changed, or became relevant, after the synced tick. Keeps them all if not synced.
+	void select_changed(ClientState& client, bool synced, ID synced_tick, PODVector<Node*>& nodes);
+	// Leave out the nodes the client extrapolates within their error threshold
+	void select_by_error(ClientState& client, PODVector<Node*>& nodes);
+	// Remember the state sent of the nodes with an error threshold, until the client acknowledges the snapshot
+	void save_sent_states(ClientState& client, const PODVector<Node*>& nodes);
+	// Extrapolate from the states of an acknowledged snapshot
+	void commit_sent_states(ClientState& client, ID snapshot_ack);
+	// Tick up to which the client has all its nodes' state, from the snapshot it acknowledged
+	bool get_synced_tick(const ClientState& client, ID& synced_tick) const;
 };
@@ -0,0 +1,55 @@
+#include "CSP_SnapshotChunks.h"
+
+bool SnapshotChunks::receive(ID new_snapshot_id, unsigned index, unsigned new_count, unsigned first_node_id, unsigned last_node_id)
+{
+	if (new_count == 0 || new_count > MAX_SNAPSHOT_CHUNKS || index >= new_count || first_node_id > last_node_id)
+		return false;
+
+	if (new_snapshot_id != snapshot_id)
+	{
+		// Handle range looping correctly
+		if (count != 0 && int(new_snapshot_id - snapshot_id) < 0)
+			return false;
+
+		if (count != 0 && !is_complete())
+			++partial_snapshots;
+
+		snapshot_id = new_snapshot_id;
+		count = new_count;
+		received_count = 0;
+		received = 0;
+		ranges.Clear();
+	}
+	else if (new_count != count)
+		return false;
+
+	const auto bit = 1ull << index;
+	if (received & bit)
+		return false;
+
+	received |= bit;
+	ranges.Push({ first_node_id, last_node_id });
+	if (++received_count == count)
+		++complete_snapshots;
+
+	return true;
+}
+
+void SnapshotChunks::clear()
+{
+	snapshot_id = 0;
+	count = 0;
+	received_count = 0;
+	received = 0;
+	ranges.Clear();
+}
+
+bool SnapshotChunks::is_received(unsigned node_id) const
+{
+	for (auto& range : ranges)
+	{
+		if (node_id >= range.first && node_id <= range.last)
+			return true;
+	}
+	return false;
+}
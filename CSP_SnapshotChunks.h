@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Urho3D/Container/Vector.h>
+
+using namespace Urho3D;
+
+
+/*
+Snapshots too big for a single datagram are split into chunks of whole nodes.
+Each chunk decodes on its own, so a lost chunk only leaves its nodes out of date.
+Chunks aren't delta compressed, and aren't used as delta baselines.
+
+chunk serialization structure:
+- state header, see CSP_Server
+- snapshot ID
+- chunk index
+- chunk count
+- first and last node ID in the chunk
+- quantized state of the chunk's nodes, starting with its format byte
+*/
+// Most chunks a snapshot can be split into
+static constexpr unsigned MAX_SNAPSHOT_CHUNKS = 64;
+// Size of a chunk's header in bytes
+static constexpr unsigned SNAPSHOT_CHUNK_HEADER_SIZE = 4 + 4 + 4 + 4 + 1 + 1 + 4 + 1 + 1 + 4 + 4;
+
+
+/*
+Tracks which chunks of the newest chunked snapshot were received.
+*/
+struct SnapshotChunks
+{
+	using ID = unsigned;
+
+	// Register a received chunk. Returns false if it's a duplicate, malformed, or of an older snapshot.
+	bool receive(ID snapshot_id, unsigned index, unsigned count, unsigned first_node_id, unsigned last_node_id);
+	void clear();
+
+	// All the chunks of the current snapshot were received
+	bool is_complete() const { return count != 0 && received_count == count; }
+	// A node is in a received chunk of the current snapshot
+	bool is_received(unsigned node_id) const;
+	ID get_snapshot_id() const { return snapshot_id; }
+
+	// Chunked snapshots received completely, and ones which were replaced by a newer snapshot while partial
+	unsigned complete_snapshots = 0;
+	unsigned partial_snapshots = 0;
+
+protected:
+	ID snapshot_id = 0;
+	unsigned count = 0;
+	unsigned received_count = 0;
+	unsigned long long received = 0;
+
+	// Node ID ranges of the received chunks
+	struct NodeRange
+	{
+		unsigned first;
+		unsigned last;
+	};
+	PODVector<NodeRange> ranges;
+};
@@ -0,0 +1,155 @@
+#include "CSP_Trace.h"
+
+#include <Urho3D/IO/Log.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Tracer::enabled_flag{ false };
+
+namespace
+{
+	struct TraceEvent
+	{
+		const char* name;
+		long long start;
+		long long duration;
+		const char* arg_names[TraceScope::MAX_ARGS];
+		long long arg_values[TraceScope::MAX_ARGS];
+	};
+
+	// Written by its thread only, read when dumping
+	struct ThreadBuffer
+	{
+		unsigned thread_index;
+		std::vector<TraceEvent> events;
+		// Events written so far, the newest events.size() of them are kept
+		std::atomic<unsigned long long> written{ 0 };
+	};
+
+	// Buffers of all the threads that recorded, kept after their threads end so their events can still be dumped
+	std::mutex buffers_mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+	unsigned capacity = 16384;
+
+	const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+	ThreadBuffer& get_thread_buffer()
+	{
+		// Registered once per thread, the only lock taken while recording
+		thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			std::lock_guard<std::mutex> lock(buffers_mutex);
+			buffers.emplace_back(new ThreadBuffer());
+			buffer = buffers.back().get();
+			buffer->thread_index = static_cast<unsigned>(buffers.size());
+			buffer->events.resize(capacity);
+		}
+		return *buffer;
+	}
+
+	void write_string(FILE* file, const char* text)
+	{
+		std::fputc('"', file);
+		for (; *text; ++text)
+		{
+			if (*text == '"' || *text == '\\')
+				std::fputc('\\', file);
+			std::fputc(*text, file);
+		}
+		std::fputc('"', file);
+	}
+}
+
+void Tracer::set_capacity(unsigned events)
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	capacity = events > 0 ? events : 1;
+}
+
+long long Tracer::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void Tracer::record(const char * name, long long start, long long duration, const char * const * arg_names, const long long * arg_values)
+{
+	auto& buffer = get_thread_buffer();
+	const auto written = buffer.written.load(std::memory_order_relaxed);
+
+	auto& event = buffer.events[written % buffer.events.size()];
+	event.name = name;
+	event.start = start;
+	event.duration = duration;
+	for (unsigned i = 0; i < TraceScope::MAX_ARGS; ++i)
+	{
+		event.arg_names[i] = arg_names[i];
+		event.arg_values[i] = arg_values[i];
+	}
+
+	// Publish the event to the dumping thread
+	buffer.written.store(written + 1, std::memory_order_release);
+}
+
+bool Tracer::write_json(const String & path)
+{
+	auto file = std::fopen(path.CString(), "wb");
+	if (!file)
+	{
+		URHO3D_LOGWARNING("Could not open the trace file " + path);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+
+	std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+	bool first = true;
+	for (auto& buffer : buffers)
+	{
+		std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"CSP thread %u\"}}",
+			first ? "" : ",", buffer->thread_index, buffer->thread_index);
+		first = false;
+
+		// The newest events, oldest first
+		const auto written = buffer->written.load(std::memory_order_acquire);
+		const auto size = buffer->events.size();
+		const auto begin = written > size ? written - size : 0;
+		for (auto i = begin; i < written; ++i)
+		{
+			// Copy the event, then check the thread didn't start overwriting its slot meanwhile, like a seqlock.
+			// The thread writes event i + size into the slot before publishing it, so written only tells it started.
+			const auto event = buffer->events[i % size];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (i + size <= buffer->written.load(std::memory_order_relaxed))
+				continue;
+
+			std::fputs(",{\"name\":", file);
+			write_string(file, event.name);
+			std::fprintf(file, ",\"cat\":\"csp\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,\"args\":{",
+				buffer->thread_index, event.start, event.duration);
+			for (unsigned arg = 0; arg < TraceScope::MAX_ARGS && event.arg_names[arg]; ++arg)
+			{
+				if (arg > 0)
+					std::fputc(',', file);
+				write_string(file, event.arg_names[arg]);
+				std::fprintf(file, ":%lld", event.arg_values[arg]);
+			}
+			std::fputs("}}", file);
+		}
+	}
+	std::fputs("]}\n", file);
+
+	const auto ok = std::ferror(file) == 0;
+	std::fclose(file);
+	return ok;
+}
+
+void Tracer::clear()
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	for (auto& buffer : buffers)
+		buffer->written.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <Urho3D/Container/Str.h>
+#include <atomic>
+
+using namespace Urho3D;
+
+
+/*
+Opt-in scoped tracing of the CSP pipeline, dumped in the Chrome trace event format for chrome://tracing and Perfetto.
+
+Each thread records into its own ring buffer, keeping its newest events, so recording takes no locks.
+Disabled, a scope costs one relaxed atomic load.
+
+	Tracer::set_enabled(true);
+	...
+	// after a rubber-banding report
+	Tracer::write_json("csp_trace.json");
+
+Scopes carry up to two integer args, like the tick and the input ID:
+	TraceScope trace("replay_step");
+	trace.arg("input", input.id);
+*/
+struct Tracer
+{
+	// Start or stop recording
+	static void set_enabled(bool enabled) { enabled_flag.store(enabled, std::memory_order_relaxed); }
+	static bool is_enabled() { return enabled_flag.load(std::memory_order_relaxed); }
+
+	// Events kept per thread, the oldest are overwritten. Applies to the threads recording for the first time.
+	static void set_capacity(unsigned events);
+
+	// Write the recorded events of all threads as Chrome trace JSON. Returns false if the file can't be written.
+	// Threads recording meanwhile may leave out their newest events, and the oldest ones they overwrite during the dump.
+	static bool write_json(const String& path);
+	// Forget the recorded events
+	static void clear();
+
+	// Microseconds since the first call
+	static long long now();
+	// Record a finished scope on the calling thread
+	static void record(const char* name, long long start, long long duration, const char* const* arg_names, const long long* arg_values);
+
+protected:
+	static std::atomic<bool> enabled_flag;
+};
+
+
+// Records the time from its construction to its destruction, if tracing was enabled at construction
+struct TraceScope
+{
+	static constexpr unsigned MAX_ARGS = 2;
+
+	// The name must outlive the trace, a string literal
+	explicit TraceScope(const char* name) : name(Tracer::is_enabled() ? name : nullptr)
+	{
+		if (this->name)
+			start = Tracer::now();
+	}
+
+	~TraceScope()
+	{
+		if (name)
+			Tracer::record(name, start, Tracer::now() - start, arg_names, arg_values);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	// Attach an integer arg, up to MAX_ARGS of them. The name must outlive the trace.
+	void arg(const char* arg_name, long long value)
+	{
+		if (!name || num_args == MAX_ARGS)
+			return;
+		arg_names[num_args] = arg_name;
+		arg_values[num_args] = value;
+		++num_args;
+	}
+
+protected:
+	const char* name;
+	long long start = 0;
+	const char* arg_names[MAX_ARGS] = {};
+	long long arg_values[MAX_ARGS] = {};
+	unsigned num_args = 0;
+};
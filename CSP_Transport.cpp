@@ -0,0 +1,60 @@
+#include "CSP_Transport.h"
+
+#include <Urho3D/Core/Context.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Network/Connection.h>
+#include <Urho3D/Network/Network.h>
+
+bool NetworkTransport::is_server_running() const
+{
+	auto network = context->GetSubsystem<Network>();
+	return network && network->IsServerRunning();
+}
+
+void NetworkTransport::get_clients(PODVector<Object*>& result) const
+{
+	result.Clear();
+	auto network = context->GetSubsystem<Network>();
+	if (!network)
+		return;
+
+	auto client_connections = network->GetClientConnections();
+	for (auto i = client_connections.Begin(); i != client_connections.End(); ++i)
+		result.Push(*i);
+}
+
+Object* NetworkTransport::get_server() const
+{
+	auto network = context->GetSubsystem<Network>();
+	return network ? network->GetServerConnection() : nullptr;
+}
+
+void NetworkTransport::send(Object * peer, int message_id, bool reliable, const VectorBuffer & message)
+{
+	static_cast<Connection*>(peer)->SendMessage(message_id, reliable, reliable, message);
+}
+
+bool NetworkTransport::is_client(Object * peer) const
+{
+	return static_cast<Connection*>(peer)->IsClient();
+}
+
+Scene* NetworkTransport::get_scene(Object * peer) const
+{
+	return static_cast<Connection*>(peer)->GetScene();
+}
+
+bool NetworkTransport::is_scene_loaded(Object * peer) const
+{
+	return static_cast<Connection*>(peer)->IsSceneLoaded();
+}
+
+Vector3 NetworkTransport::get_position(Object * peer) const
+{
+	return static_cast<Connection*>(peer)->GetPosition();
+}
+
+String NetworkTransport::get_name(Object * peer) const
+{
+	return static_cast<Connection*>(peer)->ToString();
+}
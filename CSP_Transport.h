@@ -0,0 +1,75 @@
+#pragma once
+
+#include <Urho3D/Container/RefCounted.h>
+#include <Urho3D/Container/Str.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace Urho3D
+{
+	class Context;
+	class Object;
+	class Scene;
+	class VectorBuffer;
+}
+
+using namespace Urho3D;
+
+
+/*
+Where the CSP server and client send their messages to, and learn about their peers from.
+
+Peers are the clients on the server and the server on a client, identified by an Object.
+NetworkTransport uses Urho's Network and its Connections as peers,
+LoopbackTransport connects a server and clients in the same process without sockets.
+Received messages are handed to CSP_Server::receive_message() and CSP_Client::receive_message().
+*/
+struct CSP_Transport : RefCounted
+{
+	// Server side: whether the server is running, and its clients
+	virtual bool is_server_running() const = 0;
+	virtual void get_clients(PODVector<Object*>& result) const = 0;
+	// Client side: the server, nullptr when not connected
+	virtual Object* get_server() const = 0;
+
+	// Send a message to a peer. Unreliable messages may be lost, duplicated or reordered.
+	virtual void send(Object* peer, int message_id, bool reliable, const VectorBuffer& message) = 0;
+
+	// Whether a peer is a client, as seen from the server
+	virtual bool is_client(Object* peer) const = 0;
+	// Scene replicated with a peer, and whether it finished loading
+	virtual Scene* get_scene(Object* peer) const = 0;
+	virtual bool is_scene_loaded(Object* peer) const = 0;
+	// Observer position of a client, for interest management
+	virtual Vector3 get_position(Object* peer) const = 0;
+	// Name of a peer in logs and metrics, like its address
+	virtual String get_name(Object* peer) const = 0;
+
+	// Called once per sending tick with the tick's timestep, for transports timing their messages
+	virtual void update(float time_step) {}
+};
+
+
+/*
+Urho's Network, the default transport. Peers are Connections.
+*/
+struct NetworkTransport : CSP_Transport
+{
+	explicit NetworkTransport(Context* context) : context(context) {}
+
+	bool is_server_running() const override;
+	void get_clients(PODVector<Object*>& result) const override;
+	Object* get_server() const override;
+
+	void send(Object* peer, int message_id, bool reliable, const VectorBuffer& message) override;
+
+	bool is_client(Object* peer) const override;
+	Scene* get_scene(Object* peer) const override;
+	bool is_scene_loaded(Object* peer) const override;
+	Vector3 get_position(Object* peer) const override;
+	String get_name(Object* peer) const override;
+
+protected:
+	// The Network subsystem is looked up on use, it may not exist yet when the transport is created
+	Context* context;
+};
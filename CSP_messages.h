@@ -9,4 +9,17 @@ namespace Urho3D
 	/* Server -> client */
 	// Sends a complete snapshot of the world
 	constexpr int MSG_CSP_STATE = 154;
+	// Sends part of a snapshot too big for a single datagram
+	constexpr int MSG_CSP_STATE_CHUNK = 155;
+
+	/* State snapshot formats, the first byte of each state */
+	enum SnapshotFormat : unsigned char
+	{
+		// StateSnapshot
+		SNAPSHOT_FULL = 0,
+		// QuantizedSnapshot
+		SNAPSHOT_QUANTIZED = 1,
+		// StateSchema
+		SNAPSHOT_SCHEMA = 2
+	};
 }
@@ -334,8 +334,9 @@ void MyApp::MoveCamera()
 		{
 			constexpr float CAMERA_DISTANCE = 5.0f;
 
-			// Move camera some distance away from the ball
-			cameraNode->SetPosition(ballNode->GetPosition() + cameraNode->GetRotation() * Vector3::BACK * CAMERA_DISTANCE);
+			// Move camera some distance away from the ball, following where it's shown after a snapped correction
+			const auto ballPosition = ballNode->GetPosition() + csp_client.get_visual_offset(ballNode);
+			cameraNode->SetPosition(ballPosition + cameraNode->GetRotation() * Vector3::BACK * CAMERA_DISTANCE);
 			showInstructions = true;
 		}
 	}
@@ -343,32 +344,32 @@ void MyApp::MoveCamera()
 	instructionsText_->SetVisible(showInstructions);
 }
 
-Controls MyApp::sample_input()
+InputRecord MyApp::sample_input()
 {
 	auto ui = GetSubsystem<UI>();
 	auto input = GetSubsystem<Input>();
 
-	Controls controls;
+	InputRecord controls;
 
 	// Copy mouse yaw
-	controls.yaw_ = yaw_;
+	controls.yaw = yaw_;
 
 	// Only apply WASD controls if there is no focused UI element
 	if (!ui->GetFocusElement())
 	{
-		controls.Set(CTRL_FORWARD, input->GetKeyDown(KEY_W));
-		controls.Set(CTRL_BACK, input->GetKeyDown(KEY_S));
-		controls.Set(CTRL_LEFT, input->GetKeyDown(KEY_A));
-		controls.Set(CTRL_RIGHT, input->GetKeyDown(KEY_D));
+		controls.set(CTRL_FORWARD, input->GetKeyDown(KEY_W));
+		controls.set(CTRL_BACK, input->GetKeyDown(KEY_S));
+		controls.set(CTRL_LEFT, input->GetKeyDown(KEY_A));
+		controls.set(CTRL_RIGHT, input->GetKeyDown(KEY_D));
 	}
 
 	return controls;
 }
 
-void MyApp::apply_input(Node* ballNode, const Controls& controls)
+void MyApp::apply_input(Node* ballNode, const InputRecord& controls)
 {
 	// Torque is relative to the forward vector
-	Quaternion rotation(0.0f, controls.yaw_, 0.0f);
+	Quaternion rotation(0.0f, controls.yaw, 0.0f);
 
 #define CSP_TEST_USE_PHYSICS // used for testing to make sure problems aren't related to the physics
 #ifdef CSP_TEST_USE_PHYSICS
@@ -388,13 +389,13 @@ void MyApp::apply_input(Node* ballNode, const Controls& controls)
 	// Movement torque is applied before each simulation step, which happen at 60 FPS. This makes the simulation
 	// independent from rendering framerate. We could also apply forces (which would enable in-air control),
 	// but want to emphasize that it's a ball which should only control its motion by rolling along the ground
-	if (controls.buttons_ & CTRL_FORWARD)
+	if (controls.buttons & CTRL_FORWARD)
 		change_func(rotation * Vector3::RIGHT * MOVE_TORQUE);
-	if (controls.buttons_ & CTRL_BACK)
+	if (controls.buttons & CTRL_BACK)
 		change_func(rotation * Vector3::LEFT * MOVE_TORQUE);
-	if (controls.buttons_ & CTRL_LEFT)
+	if (controls.buttons & CTRL_LEFT)
 		change_func(rotation * Vector3::FORWARD * MOVE_TORQUE);
-	if (controls.buttons_ & CTRL_RIGHT)
+	if (controls.buttons & CTRL_RIGHT)
 		change_func(rotation * Vector3::BACK * MOVE_TORQUE);
 #else
 	const float move_distance = 2.f / scene->GetComponent<PhysicsWorld>()->GetFps();
@@ -402,18 +403,18 @@ void MyApp::apply_input(Node* ballNode, const Controls& controls)
 	// Movement torque is applied before each simulation step, which happen at 60 FPS. This makes the simulation
 	// independent from rendering framerate. We could also apply forces (which would enable in-air control),
 	// but want to emphasize that it's a ball which should only control its motion by rolling along the ground
-	if (controls.buttons_ & CTRL_FORWARD)
+	if (controls.buttons & CTRL_FORWARD)
 		ballNode->SetPosition(ballNode->GetPosition() + Vector3::RIGHT * move_distance);
-	if (controls.buttons_ & CTRL_BACK)
+	if (controls.buttons & CTRL_BACK)
 		ballNode->SetPosition(ballNode->GetPosition() + Vector3::LEFT * move_distance);
-	if (controls.buttons_ & CTRL_LEFT)
+	if (controls.buttons & CTRL_LEFT)
 		ballNode->SetPosition(ballNode->GetPosition() + Vector3::FORWARD * move_distance);
-	if (controls.buttons_ & CTRL_RIGHT)
+	if (controls.buttons & CTRL_RIGHT)
 		ballNode->SetPosition(ballNode->GetPosition() + Vector3::BACK * move_distance);
 #endif
 }
 
-void MyApp::apply_input(Connection* connection, const Controls& controls)
+void MyApp::apply_input(Connection* connection, const InputRecord& controls)
 {
 	auto ballNode = serverObjects_[connection];
 	if (!ballNode)
@@ -468,14 +469,14 @@ void MyApp::HandlePhysicsPreStep(StringHash eventType, VariantMap & eventData)
 	// Client: collect controls
 	if (serverConnection)
 	{
-		if (csp_client.prediction_controls != nullptr)
+		if (csp_client.prediction_input != nullptr)
 		{
 			URHO3D_LOGDEBUG("PhysicsPreStep predict");
 
 			if (clientObjectID_) {
 				auto ballNode = scene->GetNode(clientObjectID_);
 				if (ballNode != nullptr)
-					apply_input(ballNode, *csp_client.prediction_controls);
+					apply_input(ballNode, *csp_client.prediction_input);
 			}
 		}
 		else
@@ -488,7 +489,10 @@ void MyApp::HandlePhysicsPreStep(StringHash eventType, VariantMap & eventData)
 			if (clientObjectID_) {
 				auto ballNode = scene->GetNode(clientObjectID_);
 				if (ballNode != nullptr)
+				{
+					csp_client.add_predicted_node(ballNode);
 					apply_input(ballNode, controls);
+				}
 			}
 
 			// Set the controls using the CSP system
@@ -500,29 +504,26 @@ void MyApp::HandlePhysicsPreStep(StringHash eventType, VariantMap & eventData)
 			serverConnection->SetPosition(cameraNode->GetPosition());
 		}
 	}
-	//Server: apply controls to client objects
-	else if (network->IsServerRunning()) {
-		URHO3D_LOGDEBUG("apply clients' controls");
-		auto csp = scene->GetComponent<CSP_Server>();
-
-		const auto& connections = network->GetClientConnections();
-		for (const auto& connection : connections)
-		{
-			if (csp->client_inputs[connection].empty())
-				continue;
-
-			auto& controls = csp->client_inputs[connection].front();
-			apply_input(connection, controls);
-			csp->client_input_IDs[connection] = controls.extraData_["id"].GetUInt();
-			csp->client_inputs[connection].pop();
-		}
-	}
+	// Server: CSP_Server applies the clients' controls through apply_client_input
 }
 
 void MyApp::HandlePostUpdate(StringHash eventType, VariantMap & eventData)
 {
 	// We only rotate the camera according to mouse movement since last frame, so do not need the time step
 	MoveCamera();
+
+	// Show the CSP metrics in the debug HUD
+	auto debugHud = GetSubsystem<DebugHud>();
+	if (!debugHud || !(debugHud->GetMode() & DEBUGHUD_SHOW_STATS))
+		return;
+
+	auto show_metrics = [&](const MetricsRegistry& metrics) {
+		for (auto& metric : metrics.get_metrics())
+			debugHud->SetAppStats(metric->name + " " + metric->connection + ": ", metric->get_summary());
+	};
+	show_metrics(*csp_client.metrics);
+	if (auto csp = scene->GetComponent<CSP_Server>())
+		show_metrics(*csp->metrics);
 }
 
 void MyApp::HandleConnect(StringHash eventType, VariantMap & eventData)
@@ -534,6 +535,8 @@ void MyApp::HandleConnect(StringHash eventType, VariantMap & eventData)
 
 	// setup client side prediction
 	csp_client.timestep = 1.f / scene->GetComponent<PhysicsWorld>()->GetFps();
+	// Keep the inputs just in time for the server
+	csp_client.time_dilation = true;
 
 	// Connect to server, specify scene to use as a client for replication
 	clientObjectID_ = 0; // Reset own object ID from possible previous connection
@@ -572,8 +575,12 @@ void MyApp::HandleStartServer(StringHash eventType, VariantMap & eventData)
 	// setup client side prediction
 	auto csp = scene->CreateComponent<CSP_Server>(LOCAL);
 	csp->timestep = 1.f / scene->GetComponent<PhysicsWorld>()->GetFps();
+	// Apply the clients' controls to their objects
+	csp->apply_client_input = [this](const InputRecord& controls, float timestep, Object* connection) {
+		apply_input(static_cast<Connection*>(connection), controls);
+	};
 #ifdef CSP_DEBUG
-	csp->updateInterval_ = 1.f;//debugging
+	csp->snapshot_tick_divisor = scene->GetComponent<PhysicsWorld>()->GetFps();//debugging
 #endif
 
 	UpdateButtons();
@@ -12,7 +12,6 @@ namespace Urho3D {
 	class Button;
 	class LineEdit;
 	class Connection;
-	class Controls;
 }
 
 using namespace Urho3D;
@@ -70,10 +69,10 @@ protected:
 	/// Read input and move the camera.
 	void MoveCamera();
 
-	Controls sample_input();
+	InputRecord sample_input();
 
-	void apply_input(Node* ballNode, const Controls& controls);
-	void apply_input(Connection* connection, const Controls& controls);
+	void apply_input(Node* ballNode, const InputRecord& controls);
+	void apply_input(Connection* connection, const InputRecord& controls);
 
 	/// Handle scene update event to control camera's pitch and yaw for all samples.
 	void HandleSceneUpdate(StringHash eventType, VariantMap& eventData);